@@ -1,4 +0,0 @@
-#!/bin/sh
-echo 1 > /sys/devices/platform/lirc_rpi/send
-sleep 2
-echo 1 > /sys/devices/platform/lirc_rpi/send
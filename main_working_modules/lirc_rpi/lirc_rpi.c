@@ -42,9 +42,23 @@
 #include <linux/gpio.h>
 #include <linux/of_platform.h>
 #include <linux/platform_data/bcm2708.h>
+#include <linux/workqueue.h>
+#include <linux/mutex.h>
+#include <linux/poll.h>
+#include <linux/slab.h>
+#include <linux/uaccess.h>
+#include <linux/vmalloc.h>
+#include <linux/mm.h>
+#include <linux/list.h>
+#include <linux/firmware.h>
+#include <linux/rcupdate.h>
+#include <linux/jhash.h>
+#include <linux/log2.h>
+#include "lirc_rpi.h"
 
 #define LIRC_DRIVER_NAME "lirc_rpi"
-#define RBUF_LEN 256
+/* must be a power of two */
+#define RBUF_LEN 4096
 #define LIRC_TRANSMITTER_LATENCY 50
 
 #ifndef MAX_UDELAY_MS
@@ -53,6 +67,10 @@
 #define MAX_UDELAY_US (MAX_UDELAY_MS*1000)
 #endif
 
+#ifndef LIRC_MODE2_OVERFLOW
+#define LIRC_MODE2_OVERFLOW 0x04000000
+#endif
+
 #define dprintk(fmt, args...)					\
 	do {							\
 		if (debug)					\
@@ -76,6 +94,8 @@ static int sense = -1;
 static bool softcarrier = 1;
 /* 0 = do not invert output, 1 = invert output */
 static bool invert = 0;
+/* binary keymap, see lirc_rpi_keymap_load() */
+static char *keymap_file = "lirc_rpi/keymap.bin";
 
 static unsigned long header_pulse=3561;
 static unsigned long header_space=1680;
@@ -86,36 +106,179 @@ static unsigned long zero_space=377;
 static unsigned long ptrail=500;
 static char l[64]="0000000001000000000001000000000100010010000000001011110010101111";
 
-struct gpio_chip *gpiochip;
-static int irq_num;
-static int auto_sense = 1;
+/* one per input pin, see the diversity merge */
+#define LIRC_RPI_MAX_RX 3
+#define MERGE_MAX_FRAME 512
+
+struct lirc_rpi_dev_data;
+
+/* softcarrier widths in ns, see carrier_widths() */
+struct lirc_rpi_carrier {
+	unsigned long pulse_width;
+	unsigned long space_width;
+};
+
+struct lirc_rpi_rx {
+	struct lirc_rpi_dev_data *mydrv;
+	int pin;
+	int irq;
+	int sense;
+	struct timeval lasttv;
+	/* noise filter state */
+	int pulse, space;
+	unsigned int ptr;
+	/* burst collected for the merge */
+	unsigned int len;
+	unsigned int glitches;
+	bool overflow;
+	int frame[MERGE_MAX_FRAME];
+	/* ktime_get_ns() of each edge, taken in the IRQ */
+	u64 stamp[MERGE_MAX_FRAME];
+};
 
 /* forward declarations */
-static long send_pulse(unsigned long length);
-static void send_space(long length);
-static void lirc_rpi_exit(void);
-static void send_raw_codes(void);
-static void send_hex_code(char *val); 
+struct lirc_rpi_carrier;
+static long send_pulse(struct lirc_rpi_dev_data *mydrv,
+		       const struct lirc_rpi_carrier *c, unsigned long length);
+static void send_space(struct lirc_rpi_dev_data *mydrv, long length);
+static void send_raw_codes(struct lirc_rpi_dev_data *mydrv);
+static void send_hex_code(struct lirc_rpi_dev_data *mydrv, char *val); 
+static int lirc_rpi_rx_get(struct lirc_rpi_dev_data *mydrv);
+static void lirc_rpi_rx_put(struct lirc_rpi_dev_data *mydrv);
+static ssize_t get_learn(struct device *dev, struct device_attribute *attr, char *resp);
+static ssize_t set_learn(struct device *dev, struct device_attribute *attr, const char *newval, size_t valsize);
+static ssize_t get_learned_conf(struct device *dev, struct device_attribute *attr, char *resp);
+static ssize_t learned_code_read(struct file *filp, struct kobject *kobj,
+	struct bin_attribute *attr, char *buf, loff_t off, size_t count);
+static ssize_t get_keymap(struct device *dev, struct device_attribute *attr, char *resp);
+static ssize_t set_keymap(struct device *dev, struct device_attribute *attr, const char *newval, size_t valsize);
+static ssize_t set_key(struct device *dev, struct device_attribute *attr, const char *newval, size_t valsize);
+/* only used when there is no device tree */
 static struct platform_device *lirc_rpi_dev;
-static struct timeval lasttv = { 0, 0 };
-static struct lirc_buffer rbuf;
-static spinlock_t lock;
 
-/* initialized/set in init_timing_params() */
-static unsigned int freq = 38000;
-static unsigned int duty_cycle = 50;
-static unsigned long period;
-static unsigned long pulse_width;
-static unsigned long space_width;
+/*
+ * RX ring
+ * Every sample is written once into rbuf and each open file descriptor
+ * reads it through its own cursor, so several readers can share the
+ * receiver. A reader that falls more than RBUF_LEN samples behind loses
+ * the oldest samples and reads a LIRC_MODE2_OVERFLOW in their place,
+ * the writer never waits for anyone.
+ *
+ * The ring lives in vmalloc memory behind a header page so capture
+ * tools can also mmap() it read-only, see struct lirc_rpi_ring_header.
+ */
+struct lirc_rpi_ring {
+	struct lirc_rpi_ring_header *hdr;
+	struct lirc_rpi_sample *buf;
+	wait_queue_head_t wait_poll;
+};
+
+#define RBUF_SIZE PAGE_ALIGN(PAGE_SIZE + \
+			     RBUF_LEN * sizeof(struct lirc_rpi_sample))
+
+struct lirc_rpi_reader {
+	struct lirc_rpi_dev_data *mydrv;
+	struct mutex lock;
+	u32 tail;
+	unsigned long overruns;
+};
+
+/* Learning mode
+ * Writing N to the learn attribute captures N presses of a button into
+ * learn.frame[], each frame ending on a long space or after a short
+ * silence. The capture buffer holds a whole session, so learning never
+ * depends on anyone draining rbuf. Once all frames are in, learn_work
+ * averages the ones that agree and infers the protocol timings.
+ */
+#define LEARN_MAX_REPS 16
+#define LEARN_MAX_FRAME 256
+/* spaces this long separate frames, same threshold as the noise filter */
+#define LEARN_GAP 20000
+/* longer gaps are pauses between presses, not the protocol gap */
+#define LEARN_MAX_GAP 200000
+#define LEARN_DEFAULT_GAP 100000
+#define LEARN_TIMEOUT_MS 50
+
+enum {
+	LEARN_IDLE,
+	LEARN_CAPTURING,
+	LEARN_ANALYSING,
+	LEARN_DONE,
+	LEARN_FAILED,
+};
+
+struct lirc_rpi_learn {
+	spinlock_t lock;
+	int state;
+	int error;
+	int rx_held;
+	bool overflow;
+	unsigned int reps;
+	unsigned int nframes;
+	unsigned int cur;
+	unsigned long gap_sum;
+	unsigned int gap_count;
+	unsigned int len[LEARN_MAX_REPS];
+	int frame[LEARN_MAX_REPS][LEARN_MAX_FRAME];
+	unsigned int avg[LEARN_MAX_FRAME];
+	char remote[32];
+	char key[32];
+	struct lirc_rpi_code result;
+	struct timer_list timer;
+	struct work_struct work;
+};
+
 
 /* Creating sysfs attributes */
 
 //#define to_lirc_rpi_dev_data(p)	((struct lirc_rpi_dev_data *)((p)->platform_data))
 
+/*
+ * Everything one rpi,lirc-rpi node needs, so that every node probes its
+ * own instance with its own /dev/lircN, sysfs directory and locks. The
+ * module parameters only provide the defaults.
+ */
 struct lirc_rpi_dev_data {
 	struct device *dev;
 	char code[1024];
 	int send;
+
+	struct gpio_chip *gpiochip;
+	int gpio_out_pin;
+	int sense;
+	bool softcarrier;
+	bool invert;
+	int auto_sense;
+
+	/* transmitter, initialized/set in init_timing_params() */
+	spinlock_t lock;
+	unsigned int freq;
+	unsigned int duty_cycle;
+	unsigned long period;
+	unsigned long pulse_width;
+	unsigned long space_width;
+
+	/* receivers, the IRQs are held while rx_users > 0 */
+	struct lirc_rpi_rx rx[LIRC_RPI_MAX_RX];
+	int nr_rx;
+	int nr_irqs_held;
+	struct mutex rx_mutex;
+	int rx_users;
+
+	/* diversity merge */
+	spinlock_t merge_lock;
+	struct timer_list merge_timer;
+	unsigned long merge_last_edge;
+	int merge_scratch[LIRC_RPI_MAX_RX];
+	u64 merge_scratch_ts[LIRC_RPI_MAX_RX];
+
+	struct lirc_rpi_ring rbuf;
+	struct lirc_rpi_learn learn;
+	struct mutex learn_mutex;
+
+	struct lirc_driver driver;
+	/* on lirc_rpi_instances, for the in-kernel TX API */
+	struct list_head node;
 };
 
 static ssize_t get_code(struct device *dev, struct device_attribute *attr, char *resp)
@@ -158,7 +321,7 @@ static ssize_t set_send(struct device *dev, struct device_attribute *attr, const
 	mydrv->send = newinterval;
 	if(mydrv->send==1) {
 		printk(KERN_INFO LIRC_DRIVER_NAME ": send_raw_codes function called!\n");
-		send_raw_codes();
+		send_raw_codes(mydrv);
 		//send_hex_code(mydrv->code);
 	}	
 	return valsize;
@@ -166,15 +329,30 @@ static ssize_t set_send(struct device *dev, struct device_attribute *attr, const
 
 static DEVICE_ATTR(code, S_IRUGO|S_IWUSR, get_code, set_code);
 static DEVICE_ATTR(send, S_IRUGO|S_IWUSR, get_send, set_send);
+static DEVICE_ATTR(learn, S_IRUGO|S_IWUSR, get_learn, set_learn);
+static DEVICE_ATTR(learned_conf, S_IRUGO, get_learned_conf, NULL);
+static DEVICE_ATTR(keymap, S_IRUGO|S_IWUSR, get_keymap, set_keymap);
+static DEVICE_ATTR(key, S_IWUSR, NULL, set_key);
+static BIN_ATTR_RO(learned_code, sizeof(struct lirc_rpi_code));
 
 static struct attribute *lirc_rpi_dev_attrs[] = {
 		&dev_attr_code.attr,
 		&dev_attr_send.attr,
+		&dev_attr_learn.attr,
+		&dev_attr_learned_conf.attr,
+		&dev_attr_keymap.attr,
+		&dev_attr_key.attr,
+		NULL
+};
+
+static struct bin_attribute *lirc_rpi_dev_bin_attrs[] = {
+		&bin_attr_learned_code,
 		NULL
 };
 
 static struct attribute_group lirc_rpi_dev_basic_attributes = {
 		.attrs = lirc_rpi_dev_attrs,
+		.bin_attrs = lirc_rpi_dev_bin_attrs,
 };
 
 /*static const struct attribute_group *lirc_rpi_dev_all_attributes[] = {
@@ -192,7 +370,7 @@ static struct attribute_group lirc_rpi_dev_basic_attributes = {
  * send_hex_code()
  * send_raw_codes() 
 */
-static void send_raw_codes() {
+static void send_raw_codes(struct lirc_rpi_dev_data *mydrv) {
 	int i=0;
 	long delta = 0;
 	/*unsigned long l[67]={9055,    4479,     588,     545,     588,     544,
@@ -229,6 +407,7 @@ static void send_raw_codes() {
               442,    1289,     441,    1297,     434,    1293,
               440};*/
     /*unsigned long l[231] = {3519, 1745, 436, 439, 438, 1293, 437, 440, 438, 439, 439, 438, 439, 439, 437, 440, 439, 446, 439, 438, 439, 439, 439, 438, 439, 438, 441, 434, 441, 1289, 441, 434, 443, 445, 440, 437, 440, 437, 440, 437, 440, 437, 440, 437, 440, 436, 441, 437, 440, 1303, 435, 436, 440, 437, 440, 437, 440, 1290, 440, 435, 440, 436, 441, 1288, 442, 455, 439, 445, 432, 438, 439, 438, 439, 438, 439, 438, 439, 438, 439, 437, 439, 447, 439, 1291, 439, 438, 439, 1297, 432, 1291, 439, 1290, 440, 1292, 439, 438, 439, 451, 439, 1292, 438, 445, 432, 1290, 441, 438, 439, 1292, 437, 1293, 461, 1269, 463, 1269, 470, 74001, 3530, 1745, 438, 442, 435, 1295, 437, 440, 437, 440, 437, 440, 438, 440, 437, 440, 438, 447, 436, 441, 438, 439, 438, 447, 430, 440, 462, 413, 439, 1291, 439, 437, 440, 447, 461, 416, 464, 413, 464, 412, 465, 412, 465, 412, 472, 405, 439, 438, 439, 1299, 463, 413, 439, 438, 438, 438, 439, 1291, 468, 408, 439, 437, 440, 1296, 447, 440, 440, 438, 439, 438, 439, 438, 439, 438, 439, 438, 439, 438, 439, 438, 439, 446, 439, 1297, 433, 438, 438, 1291, 439, 1290, 440, 1291, 438, 1291, 467, 412, 466, 430, 433, 1292, 465, 412, 465, 1266, 466, 411, 465, 1266, 466, 1265, 466, 1272, 461, 1265, 438};*/             
+    struct lirc_rpi_carrier c;
     unsigned long flags;
     /*unsigned long l[67]={9069,    4457,     581,     549,     583,     549,
               582,    1650,     584,     547,     585,     547,
@@ -242,41 +421,47 @@ static void send_raw_codes() {
               585,     550,     610,    1651,     610,    1625,
               610,    1650,     611,    1632,     603,    1625,
               612};*/
-    spin_lock_irqsave(&lock, flags);
+    spin_lock_irqsave(&mydrv->lock, flags);
+    c.pulse_width = mydrv->pulse_width;
+    c.space_width = mydrv->space_width;
     for (i = 0; i < 115; i++) {
 		if (i%2)
-			send_space(l[i] - delta);
+			send_space(mydrv, l[i] - delta);
 		else
-			delta = send_pulse(l[i]);
+			delta = send_pulse(mydrv, &c, l[i]);
 	}
-	gpiochip->set(gpiochip, gpio_out_pin, invert);
+	mydrv->gpiochip->set(mydrv->gpiochip, mydrv->gpio_out_pin, mydrv->invert);
 
-	spin_unlock_irqrestore(&lock, flags);
+	spin_unlock_irqrestore(&mydrv->lock, flags);
 	return;
 }
 
-static void send_hex_code(char *val) 
+static void send_hex_code(struct lirc_rpi_dev_data *mydrv, char *val) 
 {
 	long newval;
 	long i=0;
 	kstrtol(val, 16, &newval);
 	printk(KERN_INFO LIRC_DRIVER_NAME ": hex string %s decimal value is %ld\n", val, newval);
 	long delta = 0;
+	struct lirc_rpi_carrier c = {
+		.pulse_width = mydrv->pulse_width,
+		.space_width = mydrv->space_width,
+	};
 	// send header
-	delta=send_pulse(header_pulse);
-	send_space(header_space-delta);
+	delta=send_pulse(mydrv, &c, header_pulse);
+	send_space(mydrv, header_space-delta);
 	for(i=0;i<64;i++) {
 		if(l[i]=='0') {
-			delta=send_pulse(zero_pulse);
-			send_space(zero_space-delta);
+			delta=send_pulse(mydrv, &c, zero_pulse);
+			send_space(mydrv, zero_space-delta);
 		}
 		else {
-			delta=send_pulse(one_pulse);
-			send_space(one_space-delta);
+			delta=send_pulse(mydrv, &c, one_pulse);
+			send_space(mydrv, one_space-delta);
 		}
 	}
 	// send trail
-	send_pulse(ptrail); 
+	send_pulse(mydrv, &c, ptrail); 
 	return;
 }
 
@@ -296,26 +481,47 @@ static unsigned long read_current_us(void)
 	return (now.tv_sec * 1000000) + (now.tv_nsec/1000);
 }
 
-static int init_timing_params(unsigned int new_duty_cycle,
-	unsigned int new_freq)
+/* no side effects, a single send may use its own carrier */
+static int carrier_widths(unsigned int duty_cycle, unsigned int freq,
+			  struct lirc_rpi_carrier *c)
 {
-	if (1000 * 1000000L / new_freq * new_duty_cycle / 100 <=
+	unsigned long period;
+
+	if (1000 * 1000000L / freq * duty_cycle / 100 <=
 	    LIRC_TRANSMITTER_LATENCY)
 		return -EINVAL;
-	if (1000 * 1000000L / new_freq * (100 - new_duty_cycle) / 100 <=
+	if (1000 * 1000000L / freq * (100 - duty_cycle) / 100 <=
 	    LIRC_TRANSMITTER_LATENCY)
 		return -EINVAL;
-	duty_cycle = new_duty_cycle;
-	freq = new_freq;
 	period = 1000 * 1000000L / freq;
-	pulse_width = period * duty_cycle / 100;
-	space_width = period - pulse_width;
+	c->pulse_width = period * duty_cycle / 100;
+	c->space_width = period - c->pulse_width;
+	return 0;
+}
+
+static int init_timing_params(struct lirc_rpi_dev_data *mydrv,
+	unsigned int new_duty_cycle, unsigned int new_freq)
+{
+	struct lirc_rpi_carrier c;
+	unsigned long flags;
+
+	if (carrier_widths(new_duty_cycle, new_freq, &c))
+		return -EINVAL;
+	/* not in the middle of a transmission */
+	spin_lock_irqsave(&mydrv->lock, flags);
+	mydrv->duty_cycle = new_duty_cycle;
+	mydrv->freq = new_freq;
+	mydrv->period = 1000 * 1000000L / mydrv->freq;
+	mydrv->pulse_width = c.pulse_width;
+	mydrv->space_width = c.space_width;
+	spin_unlock_irqrestore(&mydrv->lock, flags);
 	dprintk("in init_timing_params, freq=%d pulse=%ld, "
-		"space=%ld\n", freq, pulse_width, space_width);
+		"space=%ld\n", new_freq, c.pulse_width, c.space_width);
 	return 0;
 }
 
-static long send_pulse_softcarrier(unsigned long length)
+static long send_pulse_softcarrier(struct lirc_rpi_dev_data *mydrv,
+	const struct lirc_rpi_carrier *c, unsigned long length)
 {
 	int flag;
 	unsigned long actual, target;
@@ -328,11 +534,13 @@ static long send_pulse_softcarrier(unsigned long length)
 
 	while (actual < length) {
 		if (flag) {
-			gpiochip->set(gpiochip, gpio_out_pin, invert);
-			target += space_width;
+			mydrv->gpiochip->set(mydrv->gpiochip,
+					     mydrv->gpio_out_pin, mydrv->invert);
+			target += c->space_width;
 		} else {
-			gpiochip->set(gpiochip, gpio_out_pin, !invert);
-			target += pulse_width;
+			mydrv->gpiochip->set(mydrv->gpiochip,
+					     mydrv->gpio_out_pin, !mydrv->invert);
+			target += c->pulse_width;
 		}
 		initial_us = actual_us;
 		target_us = actual_us + (target - actual) / 1000;
@@ -349,130 +557,324 @@ static long send_pulse_softcarrier(unsigned long length)
 	return (actual-length) / 1000;
 }
 
-static long send_pulse(unsigned long length)
+static long send_pulse(struct lirc_rpi_dev_data *mydrv,
+		       const struct lirc_rpi_carrier *c, unsigned long length)
 {
 	if (length <= 0)
 		return 0;
 
-	if (softcarrier) {
-		return send_pulse_softcarrier(length);
+	if (mydrv->softcarrier) {
+		return send_pulse_softcarrier(mydrv, c, length);
 	} else {
-		gpiochip->set(gpiochip, gpio_out_pin, !invert);
+		mydrv->gpiochip->set(mydrv->gpiochip, mydrv->gpio_out_pin,
+				     !mydrv->invert);
 		safe_udelay(length);
 		return 0;
 	}
 }
 
-static void send_space(long length)
+static void send_space(struct lirc_rpi_dev_data *mydrv, long length)
 {
-	gpiochip->set(gpiochip, gpio_out_pin, invert);
+	mydrv->gpiochip->set(mydrv->gpiochip, mydrv->gpio_out_pin,
+			     mydrv->invert);
 	if (length <= 0)
 		return;
 	safe_udelay(length);
 }
 
-static void rbwrite(int l)
+
+/* called with ln->lock held */
+static void learn_end_frame(struct lirc_rpi_learn *ln)
 {
-	if (lirc_buffer_full(&rbuf)) {
-		/* no new signals will be accepted */
-		dprintk("Buffer overrun\n");
+	if (ln->cur == 0 || ln->overflow) {
+		ln->cur = 0;
+		ln->overflow = 0;
 		return;
 	}
-	lirc_buffer_write(&rbuf, (void *)&l);
+	ln->len[ln->nframes++] = ln->cur;
+	ln->cur = 0;
+	if (ln->nframes == ln->reps) {
+		ln->state = LEARN_ANALYSING;
+		schedule_work(&ln->work);
+	}
+}
+
+static void learn_capture(struct lirc_rpi_dev_data *mydrv, int l)
+{
+	struct lirc_rpi_learn *ln = &mydrv->learn;
+	unsigned long flags;
+
+	spin_lock_irqsave(&ln->lock, flags);
+	if (ln->state != LEARN_CAPTURING)
+		goto out;
+
+	if (!(l & PULSE_BIT) && (l & PULSE_MASK) >= LEARN_GAP) {
+		if (ln->cur && !ln->overflow &&
+		    (l & PULSE_MASK) < LEARN_MAX_GAP) {
+			ln->gap_sum += l & PULSE_MASK;
+			ln->gap_count++;
+		}
+		learn_end_frame(ln);
+		goto out;
+	}
+
+	/* frames start with a pulse */
+	if (ln->cur == 0 && !(l & PULSE_BIT))
+		goto out;
+
+	if (ln->cur == LEARN_MAX_FRAME) {
+		/* too long for one button, drop it up to the next gap */
+		ln->overflow = 1;
+		goto out;
+	}
+	ln->frame[ln->nframes][ln->cur++] = l;
+	mod_timer(&ln->timer, jiffies + msecs_to_jiffies(LEARN_TIMEOUT_MS));
+out:
+	spin_unlock_irqrestore(&ln->lock, flags);
+}
+
+static void learn_timeout(unsigned long data)
+{
+	struct lirc_rpi_dev_data *mydrv = (struct lirc_rpi_dev_data *)data;
+	struct lirc_rpi_learn *ln = &mydrv->learn;
+	unsigned long flags;
+
+	spin_lock_irqsave(&ln->lock, flags);
+	if (ln->state == LEARN_CAPTURING)
+		learn_end_frame(ln);
+	spin_unlock_irqrestore(&ln->lock, flags);
+}
+
+/* ts is when the edge that ended the sample came in */
+static void rbwrite(struct lirc_rpi_dev_data *mydrv, int l, u64 ts)
+{
+	struct lirc_rpi_ring *rbuf = &mydrv->rbuf;
+	struct lirc_rpi_sample *sample;
+	u32 head = rbuf->hdr->head;
+
+	learn_capture(mydrv, l);
+
+	/*
+	 * one writer only, the IRQ handler or with several receivers the
+	 * merge timer, readers catch up on their own
+	 */
+	sample = &rbuf->buf[head & (RBUF_LEN - 1)];
+	sample->timestamp = ts;
+	sample->value = l;
+	smp_wmb();
+	WRITE_ONCE(rbuf->hdr->head, head + 1);
+	if (head + 1 - rbuf->hdr->tail > RBUF_LEN)
+		WRITE_ONCE(rbuf->hdr->tail, head + 1 - RBUF_LEN);
+}
+
+/*
+ * Diversity merge
+ * With more than one receiver each of them collects the current burst
+ * into its own rx->frame[], an edge only appends there. Once all of
+ * them have been quiet for MERGE_TIMEOUT_MS, merge_timeout() writes one
+ * clean copy of the burst to rbuf in a single batch: a per edge median
+ * when at least three copies agree on length, otherwise the agreeing
+ * copy with the fewest glitches.
+ */
+#define MERGE_TIMEOUT_MS 30
+/* edges closer than this are counted against a copy's quality */
+#define MERGE_GLITCH_US 100
+
+static void merge_add(struct lirc_rpi_rx *r, int l, u64 ts)
+{
+	struct lirc_rpi_dev_data *mydrv = r->mydrv;
+
+	spin_lock(&mydrv->merge_lock);
+	if (r->len == MERGE_MAX_FRAME) {
+		r->overflow = 1;
+	} else {
+		if (r->len && (l & PULSE_MASK) < MERGE_GLITCH_US)
+			r->glitches++;
+		r->stamp[r->len] = ts;
+		r->frame[r->len++] = l;
+	}
+	mydrv->merge_last_edge = jiffies;
+	if (!timer_pending(&mydrv->merge_timer))
+		mod_timer(&mydrv->merge_timer,
+			  jiffies + msecs_to_jiffies(MERGE_TIMEOUT_MS));
+	spin_unlock(&mydrv->merge_lock);
+}
+
+static void merge_timeout(unsigned long data)
+{
+	struct lirc_rpi_dev_data *mydrv = (struct lirc_rpi_dev_data *)data;
+	struct lirc_rpi_rx *rx = mydrv->rx;
+	int *merge_scratch = mydrv->merge_scratch;
+	u64 *merge_scratch_ts = mydrv->merge_scratch_ts;
+	unsigned long flags, quiet;
+	struct lirc_rpi_rx *best = NULL;
+	unsigned int i, j, k, n, len = 0, agree = 0, nr_rx = mydrv->nr_rx;
+
+	spin_lock_irqsave(&mydrv->merge_lock, flags);
+
+	/* an edge came in since the timer was armed, wait for silence */
+	quiet = mydrv->merge_last_edge + msecs_to_jiffies(MERGE_TIMEOUT_MS);
+	if (time_before(jiffies, quiet)) {
+		mod_timer(&mydrv->merge_timer, quiet);
+		goto out;
+	}
+
+	for (i = 0; i < nr_rx; i++) {
+		if (!rx[i].len || rx[i].overflow)
+			continue;
+		for (n = 0, j = 0; j < nr_rx; j++)
+			if (rx[j].len == rx[i].len && !rx[j].overflow)
+				n++;
+		if (n > agree || (n == agree && rx[i].len > len)) {
+			agree = n;
+			len = rx[i].len;
+		}
+	}
+
+	if (agree >= 3) {
+		/* majority vote, the median of each edge */
+		for (k = 0; k < len; k++) {
+			for (n = 0, i = 0; i < nr_rx; i++) {
+				if (rx[i].len != len || rx[i].overflow)
+					continue;
+				/* insertion sort, there are only a few */
+				for (j = n++; j > 0 &&
+				     (merge_scratch[j - 1] & PULSE_MASK) >
+				     (rx[i].frame[k] & PULSE_MASK); j--) {
+					merge_scratch[j] = merge_scratch[j - 1];
+					merge_scratch_ts[j] =
+						merge_scratch_ts[j - 1];
+				}
+				merge_scratch[j] = rx[i].frame[k];
+				merge_scratch_ts[j] = rx[i].stamp[k];
+			}
+			rbwrite(mydrv, merge_scratch[n / 2],
+				merge_scratch_ts[n / 2]);
+		}
+	} else if (agree) {
+		for (i = 0; i < nr_rx; i++) {
+			if (rx[i].len != len || rx[i].overflow)
+				continue;
+			if (!best || rx[i].glitches < best->glitches)
+				best = &rx[i];
+		}
+		for (k = 0; k < len; k++)
+			rbwrite(mydrv, best->frame[k], best->stamp[k]);
+	}
+
+	for (i = 0; i < nr_rx; i++) {
+		rx[i].len = 0;
+		rx[i].glitches = 0;
+		rx[i].overflow = 0;
+	}
+	if (agree)
+		wake_up_interruptible(&mydrv->rbuf.wait_poll);
+out:
+	spin_unlock_irqrestore(&mydrv->merge_lock, flags);
+}
+
+static void rx_emit(struct lirc_rpi_rx *r, int l, u64 ts)
+{
+	if (r->mydrv->nr_rx > 1)
+		merge_add(r, l, ts);
+	else
+		rbwrite(r->mydrv, l, ts);
 }
 
-static void frbwrite(int l)
+/* samples the filter held back are stamped with the edge flushing them */
+static void frbwrite(struct lirc_rpi_rx *r, int l, u64 ts)
 {
 	/* simple noise filter */
-	static int pulse, space;
-	static unsigned int ptr;
-
-	if (ptr > 0 && (l & PULSE_BIT)) {
-		pulse += l & PULSE_MASK;
-		if (pulse > 250) {
-			rbwrite(space);
-			rbwrite(pulse | PULSE_BIT);
-			ptr = 0;
-			pulse = 0;
+	if (r->ptr > 0 && (l & PULSE_BIT)) {
+		r->pulse += l & PULSE_MASK;
+		if (r->pulse > 250) {
+			rx_emit(r, r->space, ts);
+			rx_emit(r, r->pulse | PULSE_BIT, ts);
+			r->ptr = 0;
+			r->pulse = 0;
 		}
 		return;
 	}
 	if (!(l & PULSE_BIT)) {
-		if (ptr == 0) {
+		if (r->ptr == 0) {
 			if (l > 20000) {
-				space = l;
-				ptr++;
+				r->space = l;
+				r->ptr++;
 				return;
 			}
 		} else {
 			if (l > 20000) {
-				space += pulse;
-				if (space > PULSE_MASK)
-					space = PULSE_MASK;
-				space += l;
-				if (space > PULSE_MASK)
-					space = PULSE_MASK;
-				pulse = 0;
+				r->space += r->pulse;
+				if (r->space > PULSE_MASK)
+					r->space = PULSE_MASK;
+				r->space += l;
+				if (r->space > PULSE_MASK)
+					r->space = PULSE_MASK;
+				r->pulse = 0;
 				return;
 			}
-			rbwrite(space);
-			rbwrite(pulse | PULSE_BIT);
-			ptr = 0;
-			pulse = 0;
+			rx_emit(r, r->space, ts);
+			rx_emit(r, r->pulse | PULSE_BIT, ts);
+			r->ptr = 0;
+			r->pulse = 0;
 		}
 	}
-	rbwrite(l);
+	rx_emit(r, l, ts);
 }
 
 static irqreturn_t irq_handler(int i, void *blah, struct pt_regs *regs)
 {
+	struct lirc_rpi_rx *r = blah;
+	struct lirc_rpi_dev_data *mydrv = r->mydrv;
+	u64 ts = ktime_get_ns();
 	struct timeval tv;
 	long deltv;
 	int data;
 	int signal;
 
 	/* use the GPIO signal level */
-	signal = gpiochip->get(gpiochip, gpio_in_pin);
+	signal = mydrv->gpiochip->get(mydrv->gpiochip, r->pin);
 
-	if (sense != -1) {
+	if (r->sense != -1) {
 		/* get current time */
 		do_gettimeofday(&tv);
 
 		/* calc time since last interrupt in microseconds */
-		deltv = tv.tv_sec-lasttv.tv_sec;
-		if (tv.tv_sec < lasttv.tv_sec ||
-		    (tv.tv_sec == lasttv.tv_sec &&
-		     tv.tv_usec < lasttv.tv_usec)) {
+		deltv = tv.tv_sec-r->lasttv.tv_sec;
+		if (tv.tv_sec < r->lasttv.tv_sec ||
+		    (tv.tv_sec == r->lasttv.tv_sec &&
+		     tv.tv_usec < r->lasttv.tv_usec)) {
 			printk(KERN_WARNING LIRC_DRIVER_NAME
 			       ": AIEEEE: your clock just jumped backwards\n");
 			printk(KERN_WARNING LIRC_DRIVER_NAME
-			       ": %d %d %lx %lx %lx %lx\n", signal, sense,
-			       tv.tv_sec, lasttv.tv_sec,
-			       tv.tv_usec, lasttv.tv_usec);
+			       ": %d %d %lx %lx %lx %lx\n", signal, r->sense,
+			       tv.tv_sec, r->lasttv.tv_sec,
+			       tv.tv_usec, r->lasttv.tv_usec);
 			data = PULSE_MASK;
 		} else if (deltv > 15) {
 			data = PULSE_MASK; /* really long time */
-			if (!(signal^sense)) {
+			if (!(signal^r->sense)) {
 				/* sanity check */
 				printk(KERN_DEBUG LIRC_DRIVER_NAME
 				       ": AIEEEE: %d %d %lx %lx %lx %lx\n",
-				       signal, sense, tv.tv_sec, lasttv.tv_sec,
-				       tv.tv_usec, lasttv.tv_usec);
+				       signal, r->sense, tv.tv_sec, r->lasttv.tv_sec,
+				       tv.tv_usec, r->lasttv.tv_usec);
 				/*
 				 * detecting pulse while this
 				 * MUST be a space!
 				 */
-				if (auto_sense) {
-					sense = sense ? 0 : 1;
+				if (mydrv->auto_sense) {
+					r->sense = r->sense ? 0 : 1;
 				}
 			}
 		} else {
 			data = (int) (deltv*1000000 +
-				      (tv.tv_usec - lasttv.tv_usec));
+				      (tv.tv_usec - r->lasttv.tv_usec));
 		}
-		frbwrite(signal^sense ? data : (data|PULSE_BIT));
-		lasttv = tv;
-		wake_up_interruptible(&rbuf.wait_poll);
+		frbwrite(r, signal^r->sense ? data : (data|PULSE_BIT), ts);
+		r->lasttv = tv;
+		if (mydrv->nr_rx == 1)
+			wake_up_interruptible(&mydrv->rbuf.wait_poll);
 	}
 
 	return IRQ_HANDLED;
@@ -498,7 +900,8 @@ static inline int read_bool_property(const struct device_node *np,
 	return err;
 }
 
-static void read_pin_settings(struct device_node *node)
+static void read_pin_settings(struct lirc_rpi_dev_data *mydrv,
+			      struct device_node *node)
 {
 	u32 pin;
 	int index;
@@ -519,19 +922,56 @@ static void read_pin_settings(struct device_node *node)
 			&function);
 		if (err == 0) {
 			if (function == 1) /* Output */
-				gpio_out_pin = pin;
-			else if (function == 0) /* Input */
-				gpio_in_pin = pin;
+				mydrv->gpio_out_pin = pin;
+			else if (function == 0 && /* Input */
+				 mydrv->nr_rx < LIRC_RPI_MAX_RX)
+				mydrv->rx[mydrv->nr_rx++].pin = pin;
 		}
 	}
 }
 
-static int init_port(void)
+/* if pin is high, then this must be an active low receiver. */
+static void detect_sense(struct lirc_rpi_rx *r)
 {
+	struct gpio_chip *gpiochip = r->mydrv->gpiochip;
 	int i, nlow, nhigh;
+
+	if (r->sense == -1) {
+		/* wait 1/2 sec for the power supply */
+		msleep(500);
+
+		/*
+		 * probe 9 times every 0.04s, collect "votes" for
+		 * active high/low
+		 */
+		nlow = 0;
+		nhigh = 0;
+		for (i = 0; i < 9; i++) {
+			if (gpiochip->get(gpiochip, r->pin))
+				nlow++;
+			else
+				nhigh++;
+			msleep(40);
+		}
+		r->sense = (nlow >= nhigh ? 1 : 0);
+		printk(KERN_INFO LIRC_DRIVER_NAME
+		       ": auto-detected active %s receiver on GPIO pin %d\n",
+		       r->sense ? "low" : "high", r->pin);
+	} else {
+		printk(KERN_INFO LIRC_DRIVER_NAME
+		       ": manually using active %s receiver on GPIO pin %d\n",
+		       r->sense ? "low" : "high", r->pin);
+		r->mydrv->auto_sense = 0;
+	}
+}
+
+static int init_port(struct lirc_rpi_dev_data *mydrv)
+{
+	int i;
 	struct device_node *node;
+	struct gpio_chip *gpiochip;
 
-	node = lirc_rpi_dev->dev.of_node;
+	node = mydrv->dev->of_node;
 
 	gpiochip = gpiochip_find("bcm2708_gpio", is_right_chip);
 
@@ -546,6 +986,7 @@ static int init_port(void)
 		pr_err(LIRC_DRIVER_NAME ": gpio chip not found!\n");
 		return -ENODEV;
 	}
+	mydrv->gpiochip = gpiochip;
 
 	if (node) {
 		struct device_node *pins_node;
@@ -557,13 +998,14 @@ static int init_port(void)
 			return -EINVAL;
 		}
 
-		read_pin_settings(pins_node);
+		read_pin_settings(mydrv, pins_node);
+		of_node_put(pins_node);
 
-		of_property_read_u32(node, "rpi,sense", &sense);
+		of_property_read_u32(node, "rpi,sense", &mydrv->sense);
 
-		read_bool_property(node, "rpi,softcarrier", &softcarrier);
+		read_bool_property(node, "rpi,softcarrier", &mydrv->softcarrier);
 
-		read_bool_property(node, "rpi,invert", &invert);
+		read_bool_property(node, "rpi,invert", &mydrv->invert);
 
 		read_bool_property(node, "rpi,debug", &debug);
 
@@ -571,187 +1013,1184 @@ static int init_port(void)
 		return -EINVAL;
 	}
 
-	gpiochip->set(gpiochip, gpio_out_pin, invert);
+	gpiochip->set(gpiochip, mydrv->gpio_out_pin, mydrv->invert);
 
-	irq_num = gpiochip->to_irq(gpiochip, gpio_in_pin);
-	dprintk("to_irq %d\n", irq_num);
+	/* no input pin in the pinctrl node, fall back to gpio_in_pin */
+	if (mydrv->nr_rx == 0)
+		mydrv->rx[mydrv->nr_rx++].pin = gpio_in_pin;
 
-	/* if pin is high, then this must be an active low receiver. */
-	if (sense == -1) {
-		/* wait 1/2 sec for the power supply */
-		msleep(500);
+	for (i = 0; i < mydrv->nr_rx; i++) {
+		struct lirc_rpi_rx *r = &mydrv->rx[i];
 
-		/*
-		 * probe 9 times every 0.04s, collect "votes" for
-		 * active high/low
-		 */
-		nlow = 0;
-		nhigh = 0;
-		for (i = 0; i < 9; i++) {
-			if (gpiochip->get(gpiochip, gpio_in_pin))
-				nlow++;
-			else
-				nhigh++;
-			msleep(40);
-		}
-		sense = (nlow >= nhigh ? 1 : 0);
-		printk(KERN_INFO LIRC_DRIVER_NAME
-		       ": auto-detected active %s receiver on GPIO pin %d\n",
-		       sense ? "low" : "high", gpio_in_pin);
-	} else {
-		printk(KERN_INFO LIRC_DRIVER_NAME
-		       ": manually using active %s receiver on GPIO pin %d\n",
-		       sense ? "low" : "high", gpio_in_pin);
-		auto_sense = 0;
+		r->mydrv = mydrv;
+		r->irq = gpiochip->to_irq(gpiochip, r->pin);
+		dprintk("to_irq %d\n", r->irq);
+		r->sense = mydrv->sense;
+		detect_sense(r);
 	}
+	if (mydrv->nr_rx > 1)
+		printk(KERN_INFO LIRC_DRIVER_NAME
+		       ": merging %d receivers\n", mydrv->nr_rx);
 
 	return 0;
 }
 
-// called when the character device is opened
-static int set_use_inc(void *data)
+static void rx_disable(struct lirc_rpi_dev_data *mydrv);
+
+/* request the receiver IRQs, done for the first RX user */
+static int rx_enable(struct lirc_rpi_dev_data *mydrv)
 {
-	int result;
+	struct lirc_rpi_rx *rx = mydrv->rx;
+	int i, result;
 
-	/* initialize timestamp */
-	do_gettimeofday(&lasttv);
+	for (i = 0; i < mydrv->nr_rx; i++) {
+		/* initialize timestamp */
+		do_gettimeofday(&rx[i].lasttv);
 
-	result = request_irq(irq_num,
-			     (irq_handler_t) irq_handler,
-			     IRQ_TYPE_EDGE_RISING | IRQ_TYPE_EDGE_FALLING,
-			     LIRC_DRIVER_NAME, (void*) 0);
+		result = request_irq(rx[i].irq,
+				     (irq_handler_t) irq_handler,
+				     IRQ_TYPE_EDGE_RISING | IRQ_TYPE_EDGE_FALLING,
+				     LIRC_DRIVER_NAME, &rx[i]);
 
-	switch (result) {
-	case -EBUSY:
-		printk(KERN_ERR LIRC_DRIVER_NAME
-		       ": IRQ %d is busy\n",
-		       irq_num);
-		return -EBUSY;
-	case -EINVAL:
-		printk(KERN_ERR LIRC_DRIVER_NAME
-		       ": Bad irq number or handler\n");
-		return -EINVAL;
-	default:
-		dprintk("Interrupt %d obtained\n",
-			irq_num);
-		break;
-	};
+		switch (result) {
+		case -EBUSY:
+			printk(KERN_ERR LIRC_DRIVER_NAME
+			       ": IRQ %d is busy\n",
+			       rx[i].irq);
+			break;
+		case -EINVAL:
+			printk(KERN_ERR LIRC_DRIVER_NAME
+			       ": Bad irq number or handler\n");
+			break;
+		default:
+			dprintk("Interrupt %d obtained\n",
+				rx[i].irq);
+			break;
+		};
+		if (result) {
+			mydrv->nr_irqs_held = i;
+			rx_disable(mydrv);
+			return result;
+		}
+	}
+	mydrv->nr_irqs_held = mydrv->nr_rx;
 
 	/* initialize pulse/space widths */
-	init_timing_params(duty_cycle, freq);
+	init_timing_params(mydrv, mydrv->duty_cycle, mydrv->freq);
 
 	return 0;
 }
 
-static void set_use_dec(void *data)
+static void rx_disable(struct lirc_rpi_dev_data *mydrv)
 {
-	/* GPIO Pin Falling/Rising Edge Detect Disable */
-	irq_set_irq_type(irq_num, 0);
-	disable_irq(irq_num);
+	struct lirc_rpi_rx *rx = mydrv->rx;
+	int i;
+
+	for (i = 0; i < mydrv->nr_irqs_held; i++) {
+		/* GPIO Pin Falling/Rising Edge Detect Disable */
+		irq_set_irq_type(rx[i].irq, 0);
+		disable_irq(rx[i].irq);
 
-	free_irq(irq_num, (void *) 0);
+		free_irq(rx[i].irq, &rx[i]);
 
-	dprintk(KERN_INFO LIRC_DRIVER_NAME
-		": freed IRQ %d\n", irq_num);
+		dprintk(KERN_INFO LIRC_DRIVER_NAME
+			": freed IRQ %d\n", rx[i].irq);
+	}
+	mydrv->nr_irqs_held = 0;
+	del_timer_sync(&mydrv->merge_timer);
 }
 
-static ssize_t lirc_write(struct file *file, const char *buf,
-	size_t n, loff_t *ppos)
+/*
+ * The receiver is shared by the character device and the learning
+ * mode, the IRQ is held as long as either of them uses it.
+ */
+static int lirc_rpi_rx_get(struct lirc_rpi_dev_data *mydrv)
 {
-	int i, count;
-	unsigned long flags;
-	long delta = 0;
-	int *wbuf;
+	int result = 0;
+
+	mutex_lock(&mydrv->rx_mutex);
+	if (mydrv->rx_users == 0)
+		result = rx_enable(mydrv);
+	if (!result)
+		mydrv->rx_users++;
+	mutex_unlock(&mydrv->rx_mutex);
+	return result;
+}
 
-	count = n / sizeof(int);
-	if (n % sizeof(int) || count % 2 == 0)
-		return -EINVAL;
-	wbuf = memdup_user(buf, n);
-	if (IS_ERR(wbuf))
-		return PTR_ERR(wbuf);
-	spin_lock_irqsave(&lock, flags);
+static void lirc_rpi_rx_put(struct lirc_rpi_dev_data *mydrv)
+{
+	mutex_lock(&mydrv->rx_mutex);
+	if (--mydrv->rx_users == 0)
+		rx_disable(mydrv);
+	mutex_unlock(&mydrv->rx_mutex);
+}
 
-	for (i = 0; i < count; i++) {
-		if (i%2)
-			send_space(wbuf[i] - delta);
-		else
-			delta = send_pulse(wbuf[i]);
+// called when the character device is opened
+static int set_use_inc(void *data)
+{
+	return lirc_rpi_rx_get(data);
+}
+
+static void set_use_dec(void *data)
+{
+	lirc_rpi_rx_put(data);
+}
+
+/* Learning mode analysis */
+
+static int learn_analyse(struct lirc_rpi_dev_data *mydrv,
+			 struct lirc_rpi_code *res)
+{
+	struct lirc_rpi_learn *ln = &mydrv->learn;
+	struct lirc_rpi_timing *t = &res->timing;
+	unsigned int i, j, n, len = 0, agree = 0, start, nbits;
+	unsigned int pmin = ~0U, pmax = 0, smin = ~0U, smax = 0;
+	unsigned int lo, hi, thr, bit;
+	unsigned long one_p = 0, one_s = 0, zero_p = 0, zero_s = 0;
+	unsigned int ones = 0, zeros = 0;
+	bool use_space;
+
+	/* the most common frame length wins */
+	for (i = 0; i < ln->nframes; i++) {
+		for (n = 0, j = 0; j < ln->nframes; j++)
+			if (ln->len[j] == ln->len[i])
+				n++;
+		if (n > agree) {
+			agree = n;
+			len = ln->len[i];
+		}
+	}
+	if (agree * 2 < ln->nframes) {
+		dprintk("learn: repetitions disagree\n");
+		return -EPROTO;
 	}
-	gpiochip->set(gpiochip, gpio_out_pin, invert);
+	/* pulse first and last */
+	if (len < 3 || len % 2 == 0)
+		return -EPROTO;
 
-	spin_unlock_irqrestore(&lock, flags);
-	kfree(wbuf);
-	return n;
+	for (i = 0; i < len; i++) {
+		unsigned long sum = 0;
+
+		for (j = 0; j < ln->nframes; j++)
+			if (ln->len[j] == len)
+				sum += ln->frame[j][i] & PULSE_MASK;
+		ln->avg[i] = sum / agree;
+	}
+
+	/* a leading pulse much longer than the next one is a header */
+	start = (len >= 5 && ln->avg[0] > 2 * ln->avg[2]) ? 2 : 0;
+	nbits = (len - 1 - start) / 2;
+	if (nbits == 0 || nbits > 64)
+		return -E2BIG;
+
+	for (i = start; i < len - 1; i += 2) {
+		pmin = min(pmin, ln->avg[i]);
+		pmax = max(pmax, ln->avg[i]);
+		smin = min(smin, ln->avg[i + 1]);
+		smax = max(smax, ln->avg[i + 1]);
+	}
+
+	/* one and zero differ in whichever of pulse and space spreads most */
+	use_space = (unsigned long long)smax * pmin >=
+		    (unsigned long long)pmax * smin;
+	lo = use_space ? smin : pmin;
+	hi = use_space ? smax : pmax;
+	if (hi < lo + lo / 2) {
+		dprintk("learn: cannot tell one from zero\n");
+		return -EPROTO;
+	}
+	thr = (lo + hi) / 2;
+
+	memset(res, 0, sizeof(*res));
+	for (i = start; i < len - 1; i += 2) {
+		bit = (use_space ? ln->avg[i + 1] : ln->avg[i]) > thr;
+		res->code = (res->code << 1) | bit;
+		if (bit) {
+			one_p += ln->avg[i];
+			one_s += ln->avg[i + 1];
+			ones++;
+		} else {
+			zero_p += ln->avg[i];
+			zero_s += ln->avg[i + 1];
+			zeros++;
+		}
+	}
+
+	res->magic = LIRC_RPI_CODE_MAGIC;
+	res->reps = agree;
+	t->flags = LIRC_RPI_SPACE_ENC;
+	t->bits = nbits;
+	if (start) {
+		t->header_pulse = ln->avg[0];
+		t->header_space = ln->avg[1];
+	}
+	t->one_pulse = one_p / ones;
+	t->one_space = one_s / ones;
+	t->zero_pulse = zero_p / zeros;
+	t->zero_space = zero_s / zeros;
+	t->ptrail = ln->avg[len - 1];
+	t->gap = ln->gap_count ? ln->gap_sum / ln->gap_count :
+		 LEARN_DEFAULT_GAP;
+	/* the receiver demodulates, so the carrier is whatever we send */
+	t->frequency = mydrv->freq;
+	return 0;
 }
 
-static long lirc_ioctl(struct file *filep, unsigned int cmd, unsigned long arg)
+static void learn_work(struct work_struct *work)
 {
+	struct lirc_rpi_dev_data *mydrv =
+		container_of(work, struct lirc_rpi_dev_data, learn.work);
+	struct lirc_rpi_learn *ln = &mydrv->learn;
+	struct lirc_rpi_code res;
+	unsigned long flags;
 	int result;
-	__u32 value;
 
-	switch (cmd) {
-	case LIRC_GET_SEND_MODE:
-		return -ENOIOCTLCMD;
-		break;
+	/* ANALYSING keeps the IRQ away from the frames */
+	result = learn_analyse(mydrv, &res);
 
-	case LIRC_SET_SEND_MODE:
-		result = get_user(value, (__u32 *) arg);
-		if (result)
-			return result;
-		/* only LIRC_MODE_PULSE supported */
-		if (value != LIRC_MODE_PULSE)
-			return -ENOSYS;
-		break;
+	spin_lock_irqsave(&ln->lock, flags);
+	if (ln->state == LEARN_ANALYSING) {
+		ln->error = result;
+		ln->state = result ? LEARN_FAILED : LEARN_DONE;
+		if (!result)
+			ln->result = res;
+	}
+	spin_unlock_irqrestore(&ln->lock, flags);
 
-	case LIRC_GET_LENGTH:
-		return -ENOSYS;
-		break;
+	if (xchg(&ln->rx_held, 0))
+		lirc_rpi_rx_put(mydrv);
+	printk(KERN_INFO LIRC_DRIVER_NAME ": learning %s (%d)\n",
+	       result ? "failed" : "done", result);
+}
 
-	case LIRC_SET_SEND_DUTY_CYCLE:
-		dprintk("SET_SEND_DUTY_CYCLE\n");
-		result = get_user(value, (__u32 *) arg);
-		if (result)
-			return result;
-		if (value <= 0 || value > 100)
-			return -EINVAL;
-		return init_timing_params(value, freq);
-		break;
+static void learn_stop(struct lirc_rpi_dev_data *mydrv)
+{
+	struct lirc_rpi_learn *ln = &mydrv->learn;
+	unsigned long flags;
 
-	case LIRC_SET_SEND_CARRIER:
-		dprintk("SET_SEND_CARRIER\n");
-		result = get_user(value, (__u32 *) arg);
-		if (result)
-			return result;
-		if (value > 500000 || value < 20000)
-			return -EINVAL;
-		return init_timing_params(duty_cycle, value);
-		break;
+	spin_lock_irqsave(&ln->lock, flags);
+	ln->state = LEARN_IDLE;
+	spin_unlock_irqrestore(&ln->lock, flags);
 
+	del_timer_sync(&ln->timer);
+	cancel_work_sync(&ln->work);
+	if (xchg(&ln->rx_held, 0))
+		lirc_rpi_rx_put(mydrv);
+}
+
+static ssize_t get_learn(struct device *dev, struct device_attribute *attr, char *resp)
+{
+	struct lirc_rpi_dev_data *mydrv = dev_get_drvdata(dev);
+	struct lirc_rpi_learn *ln = &mydrv->learn;
+
+	switch (ln->state) {
+	case LEARN_CAPTURING:
+		return sprintf(resp, "capturing %u/%u\n",
+			       ln->nframes, ln->reps);
+	case LEARN_ANALYSING:
+		return sprintf(resp, "analysing\n");
+	case LEARN_DONE:
+		return sprintf(resp, "done %u/%u\n",
+			       ln->result.reps, ln->reps);
+	case LEARN_FAILED:
+		return sprintf(resp, "failed %d\n", ln->error);
 	default:
-		return lirc_dev_fop_ioctl(filep, cmd, arg);
+		return sprintf(resp, "idle\n");
 	}
-	return 0;
 }
 
-static const struct file_operations lirc_fops = {
-	.owner		= THIS_MODULE,
-	.write		= lirc_write,
-	.unlocked_ioctl	= lirc_ioctl,
-	.read		= lirc_dev_fop_read,
-	.poll		= lirc_dev_fop_poll,
-	.open		= lirc_dev_fop_open,
-	.release	= lirc_dev_fop_close,
-	.llseek		= no_llseek,
-};
+/* "N [remote [key]]" starts a session of N presses, "0" cancels */
+static ssize_t set_learn(struct device *dev, struct device_attribute *attr, const char *newval, size_t valsize)
+{
+	struct lirc_rpi_dev_data *mydrv = dev_get_drvdata(dev);
+	struct lirc_rpi_learn *ln = &mydrv->learn;
+	char remote[32], key[32];
+	unsigned long flags;
+	unsigned int reps;
+	int n, result;
 
-static struct lirc_driver driver = {
-	.name		= LIRC_DRIVER_NAME,
-	.minor		= -1,
-	.code_length	= 1,
-	.sample_rate	= 0,
-	.data		= NULL,
+	n = sscanf(newval, "%u %31s %31s", &reps, remote, key);
+	if (n < 1 || reps > LEARN_MAX_REPS)
+		return -EINVAL;
+
+	mutex_lock(&mydrv->learn_mutex);
+	learn_stop(mydrv);
+	if (reps == 0)
+		goto out;
+
+	result = lirc_rpi_rx_get(mydrv);
+	if (result) {
+		mutex_unlock(&mydrv->learn_mutex);
+		return result;
+	}
+	ln->rx_held = 1;
+
+	spin_lock_irqsave(&ln->lock, flags);
+	strlcpy(ln->remote, n > 1 ? remote : "learned", sizeof(ln->remote));
+	strlcpy(ln->key, n > 2 ? key : "KEY_LEARNED", sizeof(ln->key));
+	ln->reps = reps;
+	ln->nframes = 0;
+	ln->cur = 0;
+	ln->overflow = 0;
+	ln->gap_sum = 0;
+	ln->gap_count = 0;
+	ln->error = 0;
+	ln->state = LEARN_CAPTURING;
+	spin_unlock_irqrestore(&ln->lock, flags);
+	printk(KERN_INFO LIRC_DRIVER_NAME ": learning %s %s, press it %u times\n",
+	       ln->remote, ln->key, reps);
+out:
+	mutex_unlock(&mydrv->learn_mutex);
+	return valsize;
+}
+
+/* lircd.conf snippet for the learned button */
+static ssize_t get_learned_conf(struct device *dev, struct device_attribute *attr, char *resp)
+{
+	struct lirc_rpi_dev_data *mydrv = dev_get_drvdata(dev);
+	struct lirc_rpi_learn *ln = &mydrv->learn;
+	struct lirc_rpi_code res;
+	char remote[32], key[32];
+	unsigned long flags;
+	int len;
+
+	spin_lock_irqsave(&ln->lock, flags);
+	if (ln->state != LEARN_DONE) {
+		spin_unlock_irqrestore(&ln->lock, flags);
+		return -ENODATA;
+	}
+	res = ln->result;
+	memcpy(remote, ln->remote, sizeof(remote));
+	memcpy(key, ln->key, sizeof(key));
+	spin_unlock_irqrestore(&ln->lock, flags);
+
+	len = scnprintf(resp, PAGE_SIZE,
+			"begin remote\n\n"
+			"  name  %s\n"
+			"  bits  %13u\n"
+			"  flags SPACE_ENC\n"
+			"  eps            30\n"
+			"  aeps          100\n\n",
+			remote, res.timing.bits);
+	if (res.timing.header_pulse)
+		len += scnprintf(resp + len, PAGE_SIZE - len,
+				 "  header  %10u %5u\n",
+				 res.timing.header_pulse,
+				 res.timing.header_space);
+	len += scnprintf(resp + len, PAGE_SIZE - len,
+			 "  one     %10u %5u\n"
+			 "  zero    %10u %5u\n"
+			 "  ptrail  %10u\n"
+			 "  gap     %10u\n"
+			 "  frequency    %u\n\n"
+			 "      begin codes\n"
+			 "          %-24s 0x%0*llX\n"
+			 "      end codes\n\n"
+			 "end remote\n",
+			 res.timing.one_pulse, res.timing.one_space,
+			 res.timing.zero_pulse, res.timing.zero_space,
+			 res.timing.ptrail, res.timing.gap,
+			 res.timing.frequency, key,
+			 (int)(res.timing.bits + 3) / 4,
+			 (unsigned long long)res.code);
+	return len;
+}
+
+static ssize_t learned_code_read(struct file *filp, struct kobject *kobj,
+	struct bin_attribute *attr, char *buf, loff_t off, size_t count)
+{
+	struct lirc_rpi_dev_data *mydrv = dev_get_drvdata(kobj_to_dev(kobj));
+	struct lirc_rpi_learn *ln = &mydrv->learn;
+	struct lirc_rpi_code res;
+	unsigned long flags;
+
+	spin_lock_irqsave(&ln->lock, flags);
+	if (ln->state != LEARN_DONE) {
+		spin_unlock_irqrestore(&ln->lock, flags);
+		return -ENODATA;
+	}
+	res = ln->result;
+	spin_unlock_irqrestore(&ln->lock, flags);
+
+	return memory_read_from_buffer(buf, count, &off, &res, sizeof(res));
+}
+
+/*
+ * pulse/space pairs in microseconds, starting and ending on a pulse.
+ * freq 0 uses the carrier the instance is set to, anything else is
+ * only used for this transmission.
+ */
+static int lirc_rpi_tx_carrier(struct lirc_rpi_dev_data *mydrv,
+			       const int *buf, unsigned int count,
+			       unsigned int freq)
+{
+	struct lirc_rpi_carrier c;
+	unsigned long flags;
+	long delta = 0;
+	int i;
+
+	spin_lock_irqsave(&mydrv->lock, flags);
+
+	if (!freq) {
+		c.pulse_width = mydrv->pulse_width;
+		c.space_width = mydrv->space_width;
+	} else if (carrier_widths(mydrv->duty_cycle, freq, &c)) {
+		spin_unlock_irqrestore(&mydrv->lock, flags);
+		return -EINVAL;
+	}
+
+	for (i = 0; i < count; i++) {
+		if (i%2)
+			send_space(mydrv, buf[i] - delta);
+		else
+			delta = send_pulse(mydrv, &c, buf[i]);
+	}
+	mydrv->gpiochip->set(mydrv->gpiochip, mydrv->gpio_out_pin,
+			     mydrv->invert);
+
+	spin_unlock_irqrestore(&mydrv->lock, flags);
+	return 0;
+}
+
+static void lirc_rpi_tx(struct lirc_rpi_dev_data *mydrv, const int *buf,
+			unsigned int count)
+{
+	lirc_rpi_tx_carrier(mydrv, buf, count, 0);
+}
+
+/*
+ * In-kernel TX API
+ * Other modules, e.g. the HDMI hotplug detector, transmit through the
+ * instance registered as /dev/lirc<index> without going through
+ * userspace. The instance lock is held while sending, so an instance
+ * cannot be removed underneath a caller.
+ */
+static LIST_HEAD(lirc_rpi_instances);
+static DEFINE_MUTEX(lirc_rpi_instances_lock);
+
+/* called with lirc_rpi_instances_lock held */
+static struct lirc_rpi_dev_data *lirc_rpi_find(int index)
+{
+	struct lirc_rpi_dev_data *mydrv;
+
+	list_for_each_entry(mydrv, &lirc_rpi_instances, node)
+		if (mydrv->driver.minor == index)
+			return mydrv;
+	return NULL;
+}
+
+int lirc_rpi_send_raw(int index, const int *buf, unsigned int count)
+{
+	struct lirc_rpi_dev_data *mydrv;
+	int result = 0;
+
+	if (count % 2 == 0)
+		return -EINVAL;
+
+	mutex_lock(&lirc_rpi_instances_lock);
+	mydrv = lirc_rpi_find(index);
+	if (mydrv)
+		lirc_rpi_tx(mydrv, buf, count);
+	else
+		result = -ENODEV;
+	mutex_unlock(&lirc_rpi_instances_lock);
+	return result;
+}
+EXPORT_SYMBOL_GPL(lirc_rpi_send_raw);
+
+/* the same code "echo 1 > send" transmits */
+int lirc_rpi_send_default(int index)
+{
+	struct lirc_rpi_dev_data *mydrv;
+	int result = 0;
+
+	mutex_lock(&lirc_rpi_instances_lock);
+	mydrv = lirc_rpi_find(index);
+	if (mydrv)
+		send_raw_codes(mydrv);
+	else
+		result = -ENODEV;
+	mutex_unlock(&lirc_rpi_instances_lock);
+	return result;
+}
+EXPORT_SYMBOL_GPL(lirc_rpi_send_default);
+
+/*
+ * Keymaps
+ * The remotes of every lircd.conf we ship are compiled into one binary
+ * file (struct lirc_rpi_keymap_header in lirc_rpi.h) that is loaded
+ * through request_firmware(). The key records stay in the firmware
+ * buffer, the table only hashes remote and key name to them. It is
+ * shared by all instances and replaced as a whole on reload, senders
+ * look keys up under rcu_read_lock() and the old table is freed after
+ * a grace period.
+ */
+#define KEYMAP_MAX_REMOTES 64
+#define KEYMAP_MAX_KEYS 1024
+/* header, a pulse/space pair per bit, trailing pulse */
+#define KEYMAP_MAX_PULSES (2 + 2 * 64 + 1)
+/* between repeats when the remote has no gap */
+#define KEYMAP_DEFAULT_GAP LEARN_DEFAULT_GAP
+
+struct lirc_rpi_keymap_entry {
+	struct hlist_node node;
+	u32 hash;
+	const struct lirc_rpi_keymap_remote *remote;
+	const struct lirc_rpi_keymap_key *key;
+};
+
+struct lirc_rpi_keymap {
+	const struct firmware *fw;
+	unsigned int nr_remotes;
+	unsigned int nr_keys;
+	unsigned int hash_bits;
+	char name[64];
+	/* in the firmware buffer, for lookups by number */
+	const struct lirc_rpi_keymap_remote *remotes;
+	const struct lirc_rpi_keymap_key *keys;
+	struct lirc_rpi_keymap_entry *entries;
+	struct hlist_head hash[];
+};
+
+static struct lirc_rpi_keymap __rcu *lirc_rpi_keymap;
+/* serializes reloads */
+static DEFINE_MUTEX(lirc_rpi_keymap_lock);
+
+static u32 keymap_hash(const char *remote, const char *key)
+{
+	return jhash(key, strlen(key), jhash(remote, strlen(remote), 0));
+}
+
+static bool keymap_name_valid(const char *name)
+{
+	return name[0] && memchr(name, 0, LIRC_RPI_NAME_LEN);
+}
+
+static bool keymap_timing_valid(const struct lirc_rpi_timing *t)
+{
+	if (!(le32_to_cpu(t->flags) & LIRC_RPI_SPACE_ENC))
+		return false;
+	if (le32_to_cpu(t->bits) < 1 || le32_to_cpu(t->bits) > 64)
+		return false;
+	if (!t->one_pulse || !t->zero_pulse)
+		return false;
+	/* 0 keeps the carrier the instance is set to */
+	return !t->frequency || (le32_to_cpu(t->frequency) >= 20000 &&
+				 le32_to_cpu(t->frequency) <= 500000);
+}
+
+static void keymap_free(struct lirc_rpi_keymap *map)
+{
+	if (!map)
+		return;
+	release_firmware(map->fw);
+	kfree(map->entries);
+	kfree(map);
+}
+
+/* checks the whole file before anything points into it */
+static struct lirc_rpi_keymap *keymap_parse(const struct firmware *fw)
+{
+	const struct lirc_rpi_keymap_header *hdr;
+	const struct lirc_rpi_keymap_remote *remotes;
+	const struct lirc_rpi_keymap_key *keys;
+	struct lirc_rpi_keymap *map;
+	unsigned int nr_remotes, nr_keys, r, k, n = 0;
+
+	if (fw->size < sizeof(*hdr))
+		return ERR_PTR(-EINVAL);
+	hdr = (const void *)fw->data;
+	if (le32_to_cpu(hdr->magic) != LIRC_RPI_KEYMAP_MAGIC ||
+	    le32_to_cpu(hdr->version) != LIRC_RPI_KEYMAP_VERSION)
+		return ERR_PTR(-EINVAL);
+	nr_remotes = le32_to_cpu(hdr->nr_remotes);
+	nr_keys = le32_to_cpu(hdr->nr_keys);
+	if (nr_remotes > KEYMAP_MAX_REMOTES || nr_keys > KEYMAP_MAX_KEYS)
+		return ERR_PTR(-E2BIG);
+	if (fw->size != sizeof(*hdr) + nr_remotes * sizeof(*remotes) +
+			nr_keys * sizeof(*keys))
+		return ERR_PTR(-EINVAL);
+	remotes = (const void *)(hdr + 1);
+	keys = (const void *)(remotes + nr_remotes);
+
+	map = kzalloc(sizeof(*map) + sizeof(map->hash[0]) *
+		      roundup_pow_of_two(max(nr_keys, 16U)), GFP_KERNEL);
+	if (!map)
+		return ERR_PTR(-ENOMEM);
+	map->entries = kcalloc(nr_keys, sizeof(*map->entries), GFP_KERNEL);
+	if (nr_keys && !map->entries) {
+		kfree(map);
+		return ERR_PTR(-ENOMEM);
+	}
+	map->hash_bits = ilog2(roundup_pow_of_two(max(nr_keys, 16U)));
+	map->nr_remotes = nr_remotes;
+	map->nr_keys = nr_keys;
+	map->remotes = remotes;
+	map->keys = keys;
+
+	for (r = 0; r < nr_remotes; r++) {
+		const struct lirc_rpi_keymap_remote *rem = &remotes[r];
+		u32 first = le32_to_cpu(rem->first_key);
+		u32 count = le32_to_cpu(rem->nr_keys);
+
+		if (!keymap_name_valid(rem->name) ||
+		    !keymap_timing_valid(&rem->timing) ||
+		    first != n || count > nr_keys - first)
+			goto invalid;
+
+		for (k = first; k < first + count; k++) {
+			struct lirc_rpi_keymap_entry *e = &map->entries[n++];
+
+			if (!keymap_name_valid(keys[k].name))
+				goto invalid;
+			e->remote = rem;
+			e->key = &keys[k];
+			e->hash = keymap_hash(rem->name, keys[k].name);
+			hlist_add_head(&e->node, &map->hash[hash_min(e->hash,
+							map->hash_bits)]);
+		}
+	}
+	return map;
+
+invalid:
+	kfree(map->entries);
+	kfree(map);
+	return ERR_PTR(-EINVAL);
+}
+
+/*
+ * Loads name, or the file loaded last when name is NULL. On failure the
+ * table in use is kept. optional skips the user helper fallback and the
+ * warning when the file is missing, for the load at probe time.
+ */
+static int lirc_rpi_keymap_load(struct device *dev, const char *name,
+				bool optional)
+{
+	struct lirc_rpi_keymap *map, *old;
+	const struct firmware *fw;
+	int result;
+
+	mutex_lock(&lirc_rpi_keymap_lock);
+	old = rcu_dereference_protected(lirc_rpi_keymap,
+				lockdep_is_held(&lirc_rpi_keymap_lock));
+	if (!name)
+		name = old ? old->name : keymap_file;
+
+	if (optional)
+		result = request_firmware_direct(&fw, name, dev);
+	else
+		result = request_firmware(&fw, name, dev);
+	if (result)
+		goto out;
+	map = keymap_parse(fw);
+	if (IS_ERR(map)) {
+		release_firmware(fw);
+		result = PTR_ERR(map);
+		dev_err(dev, "keymap %s is not valid: %d\n", name, result);
+		goto out;
+	}
+	map->fw = fw;
+	strlcpy(map->name, name, sizeof(map->name));
+
+	printk(KERN_INFO LIRC_DRIVER_NAME ": keymap %s, %u remotes %u keys\n",
+	       map->name, map->nr_remotes, map->nr_keys);
+	rcu_assign_pointer(lirc_rpi_keymap, map);
+	mutex_unlock(&lirc_rpi_keymap_lock);
+
+	/* the firmware buffer cannot be released from an RCU callback */
+	synchronize_rcu();
+	keymap_free(old);
+	return 0;
+
+out:
+	mutex_unlock(&lirc_rpi_keymap_lock);
+	return result;
+}
+
+/*
+ * SPACE_ENC as lircd sends it, MSB first. Without a trailing pulse the
+ * space of the last bit runs into the gap anyway and is left out.
+ */
+static unsigned int keymap_encode(const struct lirc_rpi_timing *t, u64 code,
+				  int *buf)
+{
+	unsigned int bits = le32_to_cpu(t->bits);
+	unsigned int n = 0, i;
+
+	if (t->header_pulse) {
+		buf[n++] = le32_to_cpu(t->header_pulse);
+		buf[n++] = le32_to_cpu(t->header_space);
+	}
+	for (i = bits; i-- > 0; ) {
+		if (code & (1ULL << i)) {
+			buf[n++] = le32_to_cpu(t->one_pulse);
+			buf[n++] = le32_to_cpu(t->one_space);
+		} else {
+			buf[n++] = le32_to_cpu(t->zero_pulse);
+			buf[n++] = le32_to_cpu(t->zero_space);
+		}
+	}
+	if (t->ptrail)
+		buf[n++] = le32_to_cpu(t->ptrail);
+	else
+		n--;
+	return n;
+}
+
+/* one encoded key, ready to be sent */
+struct keymap_frame {
+	unsigned int count;
+	unsigned int freq;
+	unsigned int gap;	/* between repeats, us */
+	int buf[KEYMAP_MAX_PULSES];
+};
+
+/* called under rcu_read_lock() */
+static void keymap_frame_fill(struct keymap_frame *f,
+			      const struct lirc_rpi_keymap_remote *rem,
+			      const struct lirc_rpi_keymap_key *key)
+{
+	const struct lirc_rpi_timing *t = &rem->timing;
+	unsigned int len = 0, i;
+
+	f->count = keymap_encode(t, le64_to_cpu(key->code), f->buf);
+	f->freq = le32_to_cpu(t->frequency);
+	f->gap = le32_to_cpu(t->gap);
+	/* lircd measures a CONST_LENGTH gap from the start of the frame */
+	if (le32_to_cpu(t->flags) & LIRC_RPI_CONST_LENGTH) {
+		for (i = 0; i < f->count; i++)
+			len += f->buf[i];
+		f->gap = f->gap > len ? f->gap - len : 0;
+	}
+	if (!t->gap)
+		f->gap = KEYMAP_DEFAULT_GAP;
+}
+
+static int keymap_lookup(const char *remote, const char *key,
+			 struct keymap_frame *f)
+{
+	const struct lirc_rpi_keymap_entry *e;
+	const struct lirc_rpi_keymap *map;
+	u32 hash = keymap_hash(remote, key);
+	int result = -ENOENT;
+
+	rcu_read_lock();
+	map = rcu_dereference(lirc_rpi_keymap);
+	if (!map) {
+		result = -ENODATA;
+		goto out;
+	}
+	hlist_for_each_entry(e, &map->hash[hash_min(hash, map->hash_bits)],
+			     node) {
+		if (e->hash != hash || strcmp(e->key->name, key) ||
+		    strcmp(e->remote->name, remote))
+			continue;
+		keymap_frame_fill(f, e->remote, e->key);
+		result = 0;
+		break;
+	}
+out:
+	rcu_read_unlock();
+	return result;
+}
+
+/* remote is the record number in the keymap, key counts from its first */
+static int keymap_lookup_id(u32 remote, u32 key, struct keymap_frame *f)
+{
+	const struct lirc_rpi_keymap_remote *rem;
+	const struct lirc_rpi_keymap *map;
+	int result = -ENOENT;
+
+	rcu_read_lock();
+	map = rcu_dereference(lirc_rpi_keymap);
+	if (!map) {
+		result = -ENODATA;
+		goto out;
+	}
+	if (remote >= map->nr_remotes)
+		goto out;
+	rem = &map->remotes[remote];
+	if (key >= le32_to_cpu(rem->nr_keys))
+		goto out;
+	keymap_frame_fill(f, rem, &map->keys[le32_to_cpu(rem->first_key) +
+					     key]);
+	result = 0;
+out:
+	rcu_read_unlock();
+	return result;
+}
+
+/*
+ * Sends the frame repeat + 1 times. Interrupts are only off while a
+ * frame goes out, the gaps in between are slept.
+ */
+static int keymap_send(struct lirc_rpi_dev_data *mydrv,
+		       const struct keymap_frame *f, unsigned int repeat)
+{
+	int result;
+
+	for (;;) {
+		result = lirc_rpi_tx_carrier(mydrv, f->buf, f->count, f->freq);
+		if (result || !repeat--)
+			return result;
+		usleep_range(f->gap, f->gap + f->gap / 8);
+	}
+}
+
+int lirc_rpi_send_key(int index, const char *remote, const char *key)
+{
+	struct lirc_rpi_dev_data *mydrv;
+	struct keymap_frame *f;
+	int result;
+
+	f = kmalloc(sizeof(*f), GFP_KERNEL);
+	if (!f)
+		return -ENOMEM;
+	result = keymap_lookup(remote, key, f);
+	if (result)
+		goto out;
+
+	mutex_lock(&lirc_rpi_instances_lock);
+	mydrv = lirc_rpi_find(index);
+	if (mydrv)
+		result = keymap_send(mydrv, f, 0);
+	else
+		result = -ENODEV;
+	mutex_unlock(&lirc_rpi_instances_lock);
+out:
+	kfree(f);
+	return result;
+}
+EXPORT_SYMBOL_GPL(lirc_rpi_send_key);
+
+/* "remote KEY [repeat=N]", e.g. "casio_rem KEY_POWER repeat=2" */
+static ssize_t set_key(struct device *dev, struct device_attribute *attr, const char *newval, size_t valsize)
+{
+	struct lirc_rpi_dev_data *mydrv = dev_get_drvdata(dev);
+	char remote[LIRC_RPI_NAME_LEN], key[LIRC_RPI_NAME_LEN];
+	unsigned int repeat = 0;
+	struct keymap_frame *f;
+	const char *rest;
+	int n, result;
+
+	/* 31 is LIRC_RPI_NAME_LEN - 1 */
+	if (sscanf(newval, "%31s %31s%n", remote, key, &n) != 2)
+		return -EINVAL;
+	rest = skip_spaces(newval + n);
+	if (*rest && (sscanf(rest, "repeat=%u%n", &repeat, &n) != 1 ||
+		      *skip_spaces(rest + n)))
+		return -EINVAL;
+	if (repeat > LIRC_RPI_MAX_REPEAT)
+		return -ERANGE;
+
+	f = kmalloc(sizeof(*f), GFP_KERNEL);
+	if (!f)
+		return -ENOMEM;
+	result = keymap_lookup(remote, key, f);
+	if (!result)
+		result = keymap_send(mydrv, f, repeat);
+	kfree(f);
+	dprintk("key %s %s repeat=%u: %d\n", remote, key, repeat, result);
+	return result ? result : valsize;
+}
+
+/* LIRC_RPI_SEND_KEY */
+static int lirc_rpi_ioctl_send_key(struct lirc_rpi_dev_data *mydrv,
+				   const struct lirc_rpi_key_send __user *arg)
+{
+	struct lirc_rpi_key_send req;
+	struct keymap_frame *f;
+	int result;
+
+	if (copy_from_user(&req, arg, sizeof(req)))
+		return -EFAULT;
+	if (req.repeat > LIRC_RPI_MAX_REPEAT)
+		return -ERANGE;
+
+	f = kmalloc(sizeof(*f), GFP_KERNEL);
+	if (!f)
+		return -ENOMEM;
+	result = keymap_lookup_id(req.remote, req.key, f);
+	if (!result)
+		result = keymap_send(mydrv, f, req.repeat);
+	kfree(f);
+	return result;
+}
+
+static ssize_t get_keymap(struct device *dev, struct device_attribute *attr, char *resp)
+{
+	const struct lirc_rpi_keymap *map;
+	int len;
+
+	rcu_read_lock();
+	map = rcu_dereference(lirc_rpi_keymap);
+	if (map)
+		len = sprintf(resp, "%s remotes=%u keys=%u\n", map->name,
+			      map->nr_remotes, map->nr_keys);
+	else
+		len = sprintf(resp, "none\n");
+	rcu_read_unlock();
+	return len;
+}
+
+/* a file name loads that file, an empty line reloads the current one */
+static ssize_t set_keymap(struct device *dev, struct device_attribute *attr, const char *newval, size_t valsize)
+{
+	char name[64];
+	int result;
+
+	if (strscpy(name, newval, sizeof(name)) < 0)
+		return -ENAMETOOLONG;
+	strim(name);
+	result = lirc_rpi_keymap_load(dev, name[0] ? name : NULL, false);
+	return result ? result : valsize;
+}
+
+static ssize_t lirc_write(struct file *file, const char *buf,
+	size_t n, loff_t *ppos)
+{
+	struct lirc_rpi_reader *rd = file->private_data;
+	struct lirc_rpi_dev_data *mydrv = rd->mydrv;
+	int count;
+	int *wbuf;
+
+	count = n / sizeof(int);
+	if (n % sizeof(int) || count % 2 == 0)
+		return -EINVAL;
+	wbuf = memdup_user(buf, n);
+	if (IS_ERR(wbuf))
+		return PTR_ERR(wbuf);
+	lirc_rpi_tx(mydrv, wbuf, count);
+	kfree(wbuf);
+	return n;
+}
+
+static int lirc_open(struct inode *inode, struct file *file)
+{
+	struct lirc_rpi_dev_data *mydrv = lirc_get_pdata(file);
+	struct lirc_rpi_reader *rd;
+	int result;
+
+	rd = kzalloc(sizeof(*rd), GFP_KERNEL);
+	if (!rd)
+		return -ENOMEM;
+
+	result = lirc_rpi_rx_get(mydrv);
+	if (result) {
+		kfree(rd);
+		return result;
+	}
+
+	rd->mydrv = mydrv;
+	mutex_init(&rd->lock);
+	/* start at the newest sample, like a fresh lirc_buffer */
+	rd->tail = READ_ONCE(mydrv->rbuf.hdr->head);
+	file->private_data = rd;
+	nonseekable_open(inode, file);
+	return 0;
+}
+
+static int lirc_close(struct inode *inode, struct file *file)
+{
+	struct lirc_rpi_reader *rd = file->private_data;
+
+	lirc_rpi_rx_put(rd->mydrv);
+	if (rd->overruns)
+		dprintk("reader lost samples %lu times\n", rd->overruns);
+	kfree(rd);
+	return 0;
+}
+
+/*
+ * Copy what the reader has not seen yet. The ring is read without a
+ * lock, so after copying we check the writer did not lap us meanwhile.
+ */
+static ssize_t lirc_read(struct file *file, char __user *buf,
+	size_t n, loff_t *ppos)
+{
+	struct lirc_rpi_reader *rd = file->private_data;
+	struct lirc_rpi_ring *rbuf = &rd->mydrv->rbuf;
+	int chunk[64];
+	u32 head, i, avail;
+	size_t done = 0;
+	int result = 0;
+
+	if (n % sizeof(int))
+		return -EINVAL;
+
+	if (mutex_lock_interruptible(&rd->lock))
+		return -ERESTARTSYS;
+
+	while (done < n) {
+		head = READ_ONCE(rbuf->hdr->head);
+		if (head == rd->tail) {
+			if (done)
+				break;
+			if (file->f_flags & O_NONBLOCK) {
+				result = -EAGAIN;
+				break;
+			}
+			result = wait_event_interruptible(rbuf->wait_poll,
+					READ_ONCE(rbuf->hdr->head) != rd->tail);
+			if (result)
+				break;
+			continue;
+		}
+		smp_rmb();
+
+		/*
+		 * rbwrite() fills slot head before publishing head + 1, so
+		 * sample head - RBUF_LEN may already be half overwritten
+		 */
+		if (head - rd->tail >= RBUF_LEN) {
+			/* lapped, skip to the newer half of the ring */
+			rd->tail = head - RBUF_LEN / 2;
+			rd->overruns++;
+			chunk[0] = LIRC_MODE2_OVERFLOW;
+			if (copy_to_user(buf + done, chunk, sizeof(int))) {
+				result = -EFAULT;
+				break;
+			}
+			done += sizeof(int);
+			continue;
+		}
+
+		avail = min_t(u32, head - rd->tail,
+			      min_t(size_t, (n - done) / sizeof(int),
+				    ARRAY_SIZE(chunk)));
+		for (i = 0; i < avail; i++)
+			chunk[i] = rbuf->buf[(rd->tail + i) & (RBUF_LEN - 1)].value;
+		smp_rmb();
+		if (READ_ONCE(rbuf->hdr->head) - rd->tail >= RBUF_LEN)
+			continue;
+
+		if (copy_to_user(buf + done, chunk, avail * sizeof(int))) {
+			result = -EFAULT;
+			break;
+		}
+		rd->tail += avail;
+		done += avail * sizeof(int);
+	}
+
+	mutex_unlock(&rd->lock);
+	return done ? done : result;
+}
+
+static unsigned int lirc_poll(struct file *file, poll_table *wait)
+{
+	struct lirc_rpi_reader *rd = file->private_data;
+	struct lirc_rpi_ring *rbuf = &rd->mydrv->rbuf;
+
+	poll_wait(file, &rbuf->wait_poll, wait);
+	if (READ_ONCE(rbuf->hdr->head) != rd->tail)
+		return POLLIN | POLLRDNORM;
+	return 0;
+}
+
+/*
+ * Map the ring read-only, header page first. mmap readers tell the
+ * driver how far they got with LIRC_RPI_SET_RX_CURSOR so that poll()
+ * only wakes them up for samples they have not consumed.
+ */
+static int lirc_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	struct lirc_rpi_reader *rd = file->private_data;
+
+	if (vma->vm_flags & VM_WRITE)
+		return -EPERM;
+	vma->vm_flags &= ~VM_MAYWRITE;
+	return remap_vmalloc_range(vma, rd->mydrv->rbuf.hdr, vma->vm_pgoff);
+}
+
+static long lirc_ioctl(struct file *filep, unsigned int cmd, unsigned long arg)
+{
+	struct lirc_rpi_reader *rd = filep->private_data;
+	struct lirc_rpi_dev_data *mydrv = rd->mydrv;
+	int result;
+	__u32 value;
+
+	switch (cmd) {
+	case LIRC_GET_SEND_MODE:
+		return -ENOIOCTLCMD;
+		break;
+
+	case LIRC_SET_SEND_MODE:
+		result = get_user(value, (__u32 *) arg);
+		if (result)
+			return result;
+		/* only LIRC_MODE_PULSE supported */
+		if (value != LIRC_MODE_PULSE)
+			return -ENOSYS;
+		break;
+
+	case LIRC_GET_LENGTH:
+		return -ENOSYS;
+		break;
+
+	case LIRC_RPI_SET_RX_CURSOR:
+		result = get_user(value, (__u32 *) arg);
+		if (result)
+			return result;
+		mutex_lock(&rd->lock);
+		rd->tail = value;
+		mutex_unlock(&rd->lock);
+		break;
+
+	case LIRC_RPI_SEND_KEY:
+		return lirc_rpi_ioctl_send_key(mydrv,
+				(const struct lirc_rpi_key_send __user *)arg);
+
+	case LIRC_SET_SEND_DUTY_CYCLE:
+		dprintk("SET_SEND_DUTY_CYCLE\n");
+		result = get_user(value, (__u32 *) arg);
+		if (result)
+			return result;
+		if (value <= 0 || value > 100)
+			return -EINVAL;
+		return init_timing_params(mydrv, value, mydrv->freq);
+		break;
+
+	case LIRC_SET_SEND_CARRIER:
+		dprintk("SET_SEND_CARRIER\n");
+		result = get_user(value, (__u32 *) arg);
+		if (result)
+			return result;
+		if (value > 500000 || value < 20000)
+			return -EINVAL;
+		return init_timing_params(mydrv, mydrv->duty_cycle, value);
+		break;
+
+	default:
+		return lirc_dev_fop_ioctl(filep, cmd, arg);
+	}
+	return 0;
+}
+
+static const struct file_operations lirc_fops = {
+	.owner		= THIS_MODULE,
+	.write		= lirc_write,
+	.unlocked_ioctl	= lirc_ioctl,
+	.read		= lirc_read,
+	.poll		= lirc_poll,
+	.mmap		= lirc_mmap,
+	.open		= lirc_open,
+	.release	= lirc_close,
+	.llseek		= no_llseek,
+};
+
+/* copied into every instance, .data and .dev are filled in by probe */
+static const struct lirc_driver lirc_rpi_driver_template = {
+	.name		= LIRC_DRIVER_NAME,
+	.minor		= -1,
+	.code_length	= 1,
+	.sample_rate	= 0,
+	.features	= LIRC_CAN_SET_SEND_DUTY_CYCLE |
+			  LIRC_CAN_SET_SEND_CARRIER |
+			  LIRC_CAN_SEND_PULSE |
+			  LIRC_CAN_REC_MODE2,
+	.data		= NULL,
 	.add_to_buf	= NULL,
-	.rbuf		= &rbuf,
+	.rbuf		= NULL,
 	.set_use_inc	= set_use_inc,
 	.set_use_dec	= set_use_dec,
 	.fops		= &lirc_fops,
@@ -765,30 +2204,135 @@ static const struct of_device_id lirc_rpi_of_match[] = {
 };
 MODULE_DEVICE_TABLE(of, lirc_rpi_of_match);
 
+static int lirc_rpi_ring_alloc(struct lirc_rpi_ring *rbuf)
+{
+	rbuf->hdr = vmalloc_user(RBUF_SIZE);
+	if (!rbuf->hdr)
+		return -ENOMEM;
+	rbuf->hdr->magic = LIRC_RPI_RING_MAGIC;
+	rbuf->hdr->version = LIRC_RPI_RING_VERSION;
+	rbuf->hdr->entries = RBUF_LEN;
+	rbuf->hdr->entry_size = sizeof(struct lirc_rpi_sample);
+	rbuf->hdr->data_offset = PAGE_SIZE;
+	rbuf->buf = (void *)rbuf->hdr + PAGE_SIZE;
+	init_waitqueue_head(&rbuf->wait_poll);
+	return 0;
+}
+
+static void lirc_rpi_free_pins(struct lirc_rpi_dev_data *mydrv)
+{
+	int i;
+
+	gpio_free(mydrv->gpio_out_pin);
+	for (i = 0; i < mydrv->nr_rx; i++)
+		gpio_free(mydrv->rx[i].pin);
+}
+
 static int lirc_rpi_driver_probe(struct platform_device *pdev)
 {
-	//int result=devm_device_add_group(&pdev->dev, &lirc_rpi_dev_basic_attributes);
-	//device_add_group(&pdev->dev, &lirc_rpi_dev_basic_attributes);
 	struct lirc_rpi_dev_data *mydrv;
 	int result;
 	printk(KERN_INFO LIRC_DRIVER_NAME ": probe function called!\n");
-	//mydrv->code;
-    mydrv = devm_kzalloc(&pdev->dev, sizeof(*mydrv), GFP_KERNEL);
-    mydrv->dev = &pdev->dev;
-    platform_set_drvdata(pdev, mydrv);
-	//result=device_add_groups(&pdev->dev, lirc_rpi_dev_all_attributes);
+
+	mydrv = devm_kzalloc(&pdev->dev, sizeof(*mydrv), GFP_KERNEL);
+	if (!mydrv)
+		return -ENOMEM;
+	mydrv->dev = &pdev->dev;
+
+	/* module parameters are the defaults, DT overrides them */
+	mydrv->gpio_out_pin = gpio_out_pin;
+	mydrv->sense = sense;
+	mydrv->softcarrier = softcarrier;
+	mydrv->invert = invert;
+	mydrv->auto_sense = 1;
+	mydrv->freq = 38000;
+	mydrv->duty_cycle = 50;
+
+	spin_lock_init(&mydrv->lock);
+	spin_lock_init(&mydrv->merge_lock);
+	setup_timer(&mydrv->merge_timer, merge_timeout, (unsigned long)mydrv);
+	mutex_init(&mydrv->rx_mutex);
+
+	spin_lock_init(&mydrv->learn.lock);
+	setup_timer(&mydrv->learn.timer, learn_timeout, (unsigned long)mydrv);
+	INIT_WORK(&mydrv->learn.work, learn_work);
+	mutex_init(&mydrv->learn_mutex);
+
+	result = lirc_rpi_ring_alloc(&mydrv->rbuf);
+	if (result)
+		return result;
+
+	result = init_port(mydrv);
+	if (result < 0)
+		goto exit_buffer_free;
+
+	platform_set_drvdata(pdev, mydrv);
+
+	mydrv->driver = lirc_rpi_driver_template;
+	mydrv->driver.data = mydrv;
+	mydrv->driver.dev = &pdev->dev;
+	mydrv->driver.minor = lirc_register_driver(&mydrv->driver);
+
+	if (mydrv->driver.minor < 0) {
+		printk(KERN_ERR LIRC_DRIVER_NAME
+		       ": device registration failed with %d\n",
+		       mydrv->driver.minor);
+		result = -EIO;
+		goto exit_free_pins;
+	}
+
 	result = sysfs_create_group(&pdev->dev.kobj, &lirc_rpi_dev_basic_attributes);
-    if (result) {
-        dev_err(&pdev->dev, "sysfs creation failed\n");
-        return result;
-    }
+	if (result) {
+		dev_err(&pdev->dev, "sysfs creation failed\n");
+		goto exit_unregister;
+	}
+
+	mutex_lock(&lirc_rpi_instances_lock);
+	list_add_tail(&mydrv->node, &lirc_rpi_instances);
+	mutex_unlock(&lirc_rpi_instances_lock);
+
+	/* the first instance loads the keymap, it is optional */
+	if (!rcu_access_pointer(lirc_rpi_keymap) &&
+	    lirc_rpi_keymap_load(&pdev->dev, NULL, true))
+		dev_dbg(&pdev->dev, "no keymap, keys cannot be sent\n");
+
+	printk(KERN_INFO LIRC_DRIVER_NAME ": lirc%d registered!\n",
+	       mydrv->driver.minor);
 	return 0;
+
+	exit_unregister:
+	lirc_unregister_driver(mydrv->driver.minor);
+
+	exit_free_pins:
+	lirc_rpi_free_pins(mydrv);
+
+	exit_buffer_free:
+	vfree(mydrv->rbuf.hdr);
+
+	return result;
 }
 
 static int lirc_rpi_driver_remove(struct platform_device *pdev)
 {
-    sysfs_remove_group(&pdev->dev.kobj, &lirc_rpi_dev_basic_attributes);
-    return 0;
+	struct lirc_rpi_dev_data *mydrv = platform_get_drvdata(pdev);
+
+	mutex_lock(&lirc_rpi_instances_lock);
+	list_del(&mydrv->node);
+	mutex_unlock(&lirc_rpi_instances_lock);
+
+	sysfs_remove_group(&pdev->dev.kobj, &lirc_rpi_dev_basic_attributes);
+
+	mutex_lock(&mydrv->learn_mutex);
+	learn_stop(mydrv);
+	mutex_unlock(&mydrv->learn_mutex);
+
+	lirc_unregister_driver(mydrv->driver.minor);
+	lirc_rpi_free_pins(mydrv);
+	vfree(mydrv->rbuf.hdr);
+
+	printk(KERN_INFO LIRC_DRIVER_NAME ": lirc%d removed\n",
+	       mydrv->driver.minor);
+	return 0;
 }
 
 static struct platform_driver lirc_rpi_driver = {
@@ -798,24 +2342,25 @@ static struct platform_driver lirc_rpi_driver = {
 		.name   = LIRC_DRIVER_NAME,
 		.owner  = THIS_MODULE,
 		.of_match_table = of_match_ptr(lirc_rpi_of_match),
+		/* readers may hold /dev/lircN open, only unbind on rmmod */
+		.suppress_bind_attrs = true,
 	},
 };
 
-static int __init lirc_rpi_init(void)
+/*
+ * Every rpi,lirc-rpi node probes its own instance. Without device tree
+ * a single platform device is created so the old setup keeps working.
+ */
+static int __init lirc_rpi_init_module(void)
 {
 	struct device_node *node;
 	int result;
 
-	/* Init read buffer. */
-	result = lirc_buffer_init(&rbuf, sizeof(int), RBUF_LEN);
-	if (result < 0)
-		return -ENOMEM;
-
 	result = platform_driver_register(&lirc_rpi_driver);
 	if (result) {
 		printk(KERN_ERR LIRC_DRIVER_NAME
 		       ": lirc register returned %d\n", result);
-		goto exit_buffer_free;
+		return result;
 	}
 
 	node = of_find_compatible_node(NULL, NULL,
@@ -823,16 +2368,10 @@ static int __init lirc_rpi_init(void)
 
 	if (node) {
 		/* DT-enabled */
-		lirc_rpi_dev = of_find_device_by_node(node);
-		//lirc_rpi_dev->dev.groups = lirc_rpi_dev_all_attributes;
-		//lirc_rpi_dev->dev.platform_data=&lirc_rpidata;
-		WARN_ON(lirc_rpi_dev->dev.of_node != node);
 		of_node_put(node);
 	}
 	else {
 		lirc_rpi_dev = platform_device_alloc(LIRC_DRIVER_NAME, 0);
-		//lirc_rpi_dev->dev.groups = lirc_rpi_dev_all_attributes;
-		//lirc_rpi_dev->dev.platform_data=&lirc_rpidata;
 		if (!lirc_rpi_dev) {
 			result = -ENOMEM;
 			goto exit_driver_unregister;
@@ -843,6 +2382,8 @@ static int __init lirc_rpi_init(void)
 			goto exit_device_put;
 	}
 
+	printk(KERN_INFO LIRC_DRIVER_NAME ": driver registered!\n");
+
 	return 0;
 
 	exit_device_put:
@@ -851,65 +2392,15 @@ static int __init lirc_rpi_init(void)
 	exit_driver_unregister:
 	platform_driver_unregister(&lirc_rpi_driver);
 
-	exit_buffer_free:
-	lirc_buffer_free(&rbuf);
-
 	return result;
 }
 
-static void lirc_rpi_exit(void)
+static void __exit lirc_rpi_exit_module(void)
 {
-	if (!lirc_rpi_dev->dev.of_node)
+	if (lirc_rpi_dev)
 		platform_device_unregister(lirc_rpi_dev);
 	platform_driver_unregister(&lirc_rpi_driver);
-	lirc_buffer_free(&rbuf);
-}
-
-static int __init lirc_rpi_init_module(void)
-{
-	int result;
-
-	result = lirc_rpi_init();
-	if (result)
-		return result;
-
-	result = init_port();
-	if (result < 0)
-		goto exit_rpi;
-
-	driver.features = LIRC_CAN_SET_SEND_DUTY_CYCLE |
-			  LIRC_CAN_SET_SEND_CARRIER |
-			  LIRC_CAN_SEND_PULSE |
-			  LIRC_CAN_REC_MODE2;
-
-	driver.dev = &lirc_rpi_dev->dev;
-	driver.minor = lirc_register_driver(&driver);
-
-	if (driver.minor < 0) {
-		printk(KERN_ERR LIRC_DRIVER_NAME
-		       ": device registration failed with %d\n", result);
-		result = -EIO;
-		goto exit_rpi;
-	}
-
-	printk(KERN_INFO LIRC_DRIVER_NAME ": driver registered!\n");
-
-	return 0;
-
-	exit_rpi:
-	lirc_rpi_exit();
-
-	return result;
-}
-
-static void __exit lirc_rpi_exit_module(void)
-{
-	lirc_unregister_driver(driver.minor);
-
-	gpio_free(gpio_out_pin);
-	gpio_free(gpio_in_pin);
-
-	lirc_rpi_exit();
+	keymap_free(rcu_dereference_protected(lirc_rpi_keymap, 1));
 
 	printk(KERN_INFO LIRC_DRIVER_NAME ": cleaned up module\n");
 }
@@ -944,5 +2435,9 @@ MODULE_PARM_DESC(softcarrier, "Software carrier (0 = off, 1 = on, default on)");
 module_param(invert, bool, S_IRUGO);
 MODULE_PARM_DESC(invert, "Invert output (0 = off, 1 = on, default off");
 
+module_param(keymap_file, charp, S_IRUGO);
+MODULE_PARM_DESC(keymap_file, "Keymap loaded through request_firmware"
+		 " (default lirc_rpi/keymap.bin)");
+
 module_param(debug, bool, S_IRUGO | S_IWUSR);
 MODULE_PARM_DESC(debug, "Enable debugging messages");
@@ -0,0 +1,145 @@
+/*
+ * lirc_rpi.h
+ *
+ * Structures and ioctls shared between lirc_rpi and userspace, and the
+ * functions lirc_rpi exports to other modules.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ */
+
+#ifndef _LIRC_RPI_H
+#define _LIRC_RPI_H
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+/* lirc_rpi_timing.flags, same meaning as the lircd.conf flags */
+#define LIRC_RPI_SPACE_ENC	0x0001
+#define LIRC_RPI_CONST_LENGTH	0x0002
+
+/* protocol timings in microseconds, as found in a lircd.conf remote */
+struct lirc_rpi_timing {
+	__u32 flags;
+	__u32 bits;
+	__u32 header_pulse;
+	__u32 header_space;
+	__u32 one_pulse;
+	__u32 one_space;
+	__u32 zero_pulse;
+	__u32 zero_space;
+	__u32 ptrail;
+	__u32 gap;
+	__u32 frequency;
+};
+
+#define LIRC_RPI_CODE_MAGIC	0x3143524c	/* "LRC1" */
+
+/*
+ * Compact record of a learned button, read from the learned_code
+ * sysfs attribute. The code is sent MSB first, like lircd does.
+ */
+struct lirc_rpi_code {
+	__u32 magic;
+	__u32 reps;		/* repetitions the averages were taken from */
+	struct lirc_rpi_timing timing;
+	__u64 code;
+};
+
+#define LIRC_RPI_RING_MAGIC	0x474e524c	/* "LRNG" */
+#define LIRC_RPI_RING_VERSION	1
+
+/*
+ * Layout of the RX ring as seen through mmap() on /dev/lircN. The
+ * header fills the first page and the samples start at data_offset.
+ * head counts every sample ever written (modulo 2^32), sample i lives
+ * at index i % entries, and tail is the oldest sample still in the
+ * ring. The writer fills slot head before it publishes head + 1, so a
+ * reader copies a sample, then re-reads head: if head is entries or
+ * more past the sample, it may have been overwritten meanwhile.
+ */
+struct lirc_rpi_ring_header {
+	__u32 magic;
+	__u32 version;
+	__u32 entries;
+	__u32 entry_size;
+	__u32 data_offset;
+	__u32 head;
+	__u32 tail;
+	__u32 reserved;
+};
+
+struct lirc_rpi_sample {
+	__u64 timestamp;	/* CLOCK_MONOTONIC, ns */
+	__u32 value;		/* mode2 pulse/space word */
+	__u32 reserved;
+};
+
+#define LIRC_RPI_KEYMAP_MAGIC	0x504d4b4c	/* "LKMP" */
+#define LIRC_RPI_KEYMAP_VERSION	1
+#define LIRC_RPI_NAME_LEN	32
+
+/*
+ * Binary keymap, compiled from lircd.conf files by tools/lircd2keymap
+ * and loaded with request_firmware(). All fields are little endian.
+ * The header is followed by nr_remotes remote records and then by
+ * nr_keys key records; the keys of a remote are the nr_keys records
+ * starting at first_key, right after those of the remote before it.
+ * Names are NUL terminated. pre_data and post_data are already folded
+ * into code and timing.bits.
+ */
+struct lirc_rpi_keymap_header {
+	__u32 magic;
+	__u32 version;
+	__u32 nr_remotes;
+	__u32 nr_keys;
+};
+
+struct lirc_rpi_keymap_remote {
+	char name[LIRC_RPI_NAME_LEN];
+	struct lirc_rpi_timing timing;
+	__u32 first_key;
+	__u32 nr_keys;
+	__u32 reserved;		/* keeps the key records 8 byte aligned */
+};
+
+struct lirc_rpi_keymap_key {
+	char name[LIRC_RPI_NAME_LEN];
+	__u64 code;
+};
+
+/* how far an mmap reader has consumed, for poll() */
+#define LIRC_RPI_SET_RX_CURSOR	_IOW('i', 0x00000080, __u32)
+
+#define LIRC_RPI_MAX_REPEAT	16
+
+/*
+ * Sends a key of the loaded keymap, like "remote KEY repeat=N" written
+ * to the key attribute does. remote is the remote's record number in
+ * the keymap and key counts from that remote's first key, in the order
+ * lircd2keymap -l prints them. The frame goes out repeat + 1 times.
+ */
+struct lirc_rpi_key_send {
+	__u32 remote;
+	__u32 key;
+	__u32 repeat;
+	__u32 reserved;
+};
+
+#define LIRC_RPI_SEND_KEY	_IOW('i', 0x00000081, struct lirc_rpi_key_send)
+
+#ifdef __KERNEL__
+/*
+ * In-kernel TX API, index is N of /dev/lircN. buf holds pulse/space
+ * lengths in microseconds and count must be odd. Process context only,
+ * both busy-wait for the whole transmission with interrupts off.
+ */
+int lirc_rpi_send_raw(int index, const int *buf, unsigned int count);
+int lirc_rpi_send_default(int index);
+/* looks the key up in the loaded keymap, -ENOENT if it is not there */
+int lirc_rpi_send_key(int index, const char *remote, const char *key);
+#endif
+
+#endif /* _LIRC_RPI_H */
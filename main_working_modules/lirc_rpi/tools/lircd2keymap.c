@@ -0,0 +1,353 @@
+/*
+ * lircd2keymap.c
+ *
+ * Compiles lircd.conf remotes into the binary keymap lirc_rpi loads
+ * through request_firmware(), see struct lirc_rpi_keymap_header.
+ *
+ *   lircd2keymap -o /lib/firmware/lirc_rpi/keymap.bin casio_hex.lirc.conf
+ *
+ * -l also lists the remote and key numbers LIRC_RPI_SEND_KEY takes.
+ *
+ * Only SPACE_ENC remotes with hex codes are supported, others are
+ * skipped with a warning. pre_data and post_data are folded into the
+ * codes, so they must fit into 64 bits together.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ */
+
+#include <endian.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include "../lirc_rpi.h"
+
+/* the module rejects bigger files */
+#define MAX_REMOTES 64
+#define MAX_KEYS 1024
+
+struct remote {
+	struct lirc_rpi_keymap_remote rec;	/* host byte order */
+	unsigned int pre_bits, post_bits;
+	unsigned long long pre, post;
+	int unsupported;
+	const char *file;
+	int line;
+};
+
+static struct remote remotes[MAX_REMOTES];
+static struct lirc_rpi_keymap_key keys[MAX_KEYS];
+static unsigned int nr_remotes, nr_keys;
+
+static void die(const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	fprintf(stderr, "lircd2keymap: ");
+	vfprintf(stderr, fmt, ap);
+	va_end(ap);
+	exit(1);
+}
+
+static unsigned long long number(const char *s, const char *file, int line)
+{
+	unsigned long long v;
+	char *end;
+
+	if (!s)
+		die("%s:%d: value missing\n", file, line);
+	errno = 0;
+	v = strtoull(s, &end, 0);
+	if (errno || *end)
+		die("%s:%d: bad number '%s'\n", file, line, s);
+	return v;
+}
+
+static void copy_name(char *dst, const char *src, const char *file, int line)
+{
+	if (!src)
+		die("%s:%d: name missing\n", file, line);
+	if (strlen(src) >= LIRC_RPI_NAME_LEN)
+		die("%s:%d: '%s' is longer than %d characters\n", file, line,
+		    src, LIRC_RPI_NAME_LEN - 1);
+	strcpy(dst, src);
+}
+
+static void parse_flags(struct remote *r, char *s)
+{
+	char *f;
+
+	for (f = strtok(s, "|"); f; f = strtok(NULL, "|")) {
+		if (!strcasecmp(f, "SPACE_ENC"))
+			r->rec.timing.flags |= LIRC_RPI_SPACE_ENC;
+		else if (!strcasecmp(f, "CONST_LENGTH"))
+			r->rec.timing.flags |= LIRC_RPI_CONST_LENGTH;
+		else
+			r->unsupported = 1;
+	}
+}
+
+/* a key/value line inside "begin remote" but outside the codes */
+static void remote_line(struct remote *r, char **tok, const char *file,
+			int line)
+{
+	struct lirc_rpi_timing *t = &r->rec.timing;
+	const char *k = tok[0];
+
+	if (!strcasecmp(k, "name")) {
+		copy_name(r->rec.name, tok[1], file, line);
+	} else if (!strcasecmp(k, "bits")) {
+		t->bits = number(tok[1], file, line);
+	} else if (!strcasecmp(k, "flags")) {
+		if (tok[1])
+			parse_flags(r, tok[1]);
+	} else if (!strcasecmp(k, "header")) {
+		t->header_pulse = number(tok[1], file, line);
+		t->header_space = number(tok[2], file, line);
+	} else if (!strcasecmp(k, "one")) {
+		t->one_pulse = number(tok[1], file, line);
+		t->one_space = number(tok[2], file, line);
+	} else if (!strcasecmp(k, "zero")) {
+		t->zero_pulse = number(tok[1], file, line);
+		t->zero_space = number(tok[2], file, line);
+	} else if (!strcasecmp(k, "ptrail")) {
+		t->ptrail = number(tok[1], file, line);
+	} else if (!strcasecmp(k, "gap")) {
+		t->gap = number(tok[1], file, line);
+	} else if (!strcasecmp(k, "frequency")) {
+		t->frequency = number(tok[1], file, line);
+	} else if (!strcasecmp(k, "pre_data_bits")) {
+		r->pre_bits = number(tok[1], file, line);
+	} else if (!strcasecmp(k, "pre_data")) {
+		r->pre = number(tok[1], file, line);
+	} else if (!strcasecmp(k, "post_data_bits")) {
+		r->post_bits = number(tok[1], file, line);
+	} else if (!strcasecmp(k, "post_data")) {
+		r->post = number(tok[1], file, line);
+	} else if (!strcasecmp(k, "pre") || !strcasecmp(k, "post") ||
+		   !strcasecmp(k, "plead") || !strcasecmp(k, "foot") ||
+		   !strcasecmp(k, "repeat")) {
+		/* changes the frame, the module cannot encode it */
+		r->unsupported = 1;
+	}
+	/* eps, aeps, toggle_bit_mask and the like only matter to lircd */
+}
+
+static unsigned long long mask(unsigned int bits)
+{
+	return bits >= 64 ? ~0ULL : (1ULL << bits) - 1;
+}
+
+/* checks a finished remote and keeps it, or drops it and its keys */
+static void remote_end(struct remote *r)
+{
+	struct lirc_rpi_timing *t = &r->rec.timing;
+	unsigned int bits = r->pre_bits + t->bits + r->post_bits;
+	const char *why = NULL;
+	unsigned int k;
+
+	if (r->unsupported || !(t->flags & LIRC_RPI_SPACE_ENC))
+		why = "only SPACE_ENC is supported";
+	else if (!r->rec.name[0])
+		why = "it has no name";
+	else if (!t->bits || bits > 64)
+		why = "codes must have 1 to 64 bits";
+	else if (!t->one_pulse || !t->zero_pulse)
+		why = "one or zero is missing";
+	else if (t->frequency && (t->frequency < 20000 ||
+				  t->frequency > 500000))
+		why = "the carrier is out of range";
+	else if (!r->rec.nr_keys)
+		why = "it has no codes";
+
+	if (why) {
+		fprintf(stderr, "%s:%d: skipping remote '%s', %s\n", r->file,
+			r->line, r->rec.name, why);
+		nr_keys = r->rec.first_key;
+		return;
+	}
+
+	for (k = r->rec.first_key; k < nr_keys; k++)
+		keys[k].code = (r->pre & mask(r->pre_bits)) <<
+				(t->bits + r->post_bits) |
+			(keys[k].code & mask(t->bits)) << r->post_bits |
+			(r->post & mask(r->post_bits));
+	t->bits = bits;
+	nr_remotes++;
+}
+
+static void parse_file(const char *file)
+{
+	enum { OUTSIDE, REMOTE, CODES, RAW } state = OUTSIDE;
+	struct remote *r = NULL;
+	char buf[512], *tok[4], *p;
+	int line = 0, n;
+	FILE *f;
+
+	f = fopen(file, "r");
+	if (!f)
+		die("%s: %s\n", file, strerror(errno));
+
+	while (fgets(buf, sizeof(buf), f)) {
+		line++;
+		p = strchr(buf, '#');
+		if (p)
+			*p = 0;
+		for (n = 0, p = strtok(buf, " \t\r\n"); p && n < 4;
+		     p = strtok(NULL, " \t\r\n"))
+			tok[n++] = p;
+		if (!n)
+			continue;
+		while (n < 4)
+			tok[n++] = NULL;
+
+		if (!strcasecmp(tok[0], "begin") && tok[1]) {
+			if (state == OUTSIDE && !strcasecmp(tok[1], "remote")) {
+				if (nr_remotes == MAX_REMOTES)
+					die("%s:%d: more than %d remotes\n",
+					    file, line, MAX_REMOTES);
+				r = &remotes[nr_remotes];
+				memset(r, 0, sizeof(*r));
+				r->rec.first_key = nr_keys;
+				r->file = file;
+				r->line = line;
+				state = REMOTE;
+			} else if (state == REMOTE &&
+				   !strcasecmp(tok[1], "codes")) {
+				state = CODES;
+			} else if (state == REMOTE &&
+				   !strcasecmp(tok[1], "raw_codes")) {
+				r->unsupported = 1;
+				state = RAW;
+			}
+		} else if (!strcasecmp(tok[0], "end") && tok[1]) {
+			if (state == REMOTE && !strcasecmp(tok[1], "remote")) {
+				remote_end(r);
+				state = OUTSIDE;
+			} else if (state == CODES || state == RAW) {
+				state = REMOTE;
+			}
+		} else if (state == REMOTE) {
+			remote_line(r, tok, file, line);
+		} else if (state == CODES) {
+			if (nr_keys == MAX_KEYS)
+				die("%s:%d: more than %d keys\n", file, line,
+				    MAX_KEYS);
+			copy_name(keys[nr_keys].name, tok[0], file, line);
+			keys[nr_keys].code = number(tok[1], file, line);
+			nr_keys++;
+			r->rec.nr_keys++;
+		}
+		/* anything outside a remote is ignored, like lircd does */
+	}
+	if (state != OUTSIDE)
+		die("%s: unterminated remote '%s'\n", file, r->rec.name);
+	fclose(f);
+}
+
+static void put(FILE *f, const void *p, size_t len)
+{
+	if (fwrite(p, len, 1, f) != 1)
+		die("write: %s\n", strerror(errno));
+}
+
+static void write_keymap(const char *out)
+{
+	struct lirc_rpi_keymap_header hdr;
+	unsigned int i;
+	FILE *f;
+
+	f = out ? fopen(out, "wb") : stdout;
+	if (!f)
+		die("%s: %s\n", out, strerror(errno));
+
+	hdr.magic = htole32(LIRC_RPI_KEYMAP_MAGIC);
+	hdr.version = htole32(LIRC_RPI_KEYMAP_VERSION);
+	hdr.nr_remotes = htole32(nr_remotes);
+	hdr.nr_keys = htole32(nr_keys);
+	put(f, &hdr, sizeof(hdr));
+
+	for (i = 0; i < nr_remotes; i++) {
+		struct lirc_rpi_keymap_remote rec = remotes[i].rec;
+		struct lirc_rpi_timing *t = &rec.timing;
+
+		t->flags = htole32(t->flags);
+		t->bits = htole32(t->bits);
+		t->header_pulse = htole32(t->header_pulse);
+		t->header_space = htole32(t->header_space);
+		t->one_pulse = htole32(t->one_pulse);
+		t->one_space = htole32(t->one_space);
+		t->zero_pulse = htole32(t->zero_pulse);
+		t->zero_space = htole32(t->zero_space);
+		t->ptrail = htole32(t->ptrail);
+		t->gap = htole32(t->gap);
+		t->frequency = htole32(t->frequency);
+		rec.first_key = htole32(rec.first_key);
+		rec.nr_keys = htole32(rec.nr_keys);
+		put(f, &rec, sizeof(rec));
+	}
+	for (i = 0; i < nr_keys; i++) {
+		struct lirc_rpi_keymap_key key = keys[i];
+
+		key.code = htole64(key.code);
+		put(f, &key, sizeof(key));
+	}
+
+	if (fclose(f))
+		die("%s: %s\n", out ? out : "stdout", strerror(errno));
+}
+
+/* the numbers LIRC_RPI_SEND_KEY takes */
+static void list_keys(void)
+{
+	unsigned int r, k;
+
+	for (r = 0; r < nr_remotes; r++) {
+		const struct lirc_rpi_keymap_remote *rec = &remotes[r].rec;
+
+		for (k = 0; k < rec->nr_keys; k++)
+			printf("%u %u %s %s 0x%llX\n", r, k, rec->name,
+			       keys[rec->first_key + k].name,
+			       (unsigned long long)
+			       keys[rec->first_key + k].code);
+	}
+}
+
+int main(int argc, char **argv)
+{
+	const char *out = NULL;
+	int opt, list = 0;
+
+	while ((opt = getopt(argc, argv, "lo:")) != -1) {
+		if (opt == 'l')
+			list = 1;
+		else if (opt == 'o')
+			out = optarg;
+		else
+			goto usage;
+	}
+	/* the listing goes to stdout, so the keymap cannot */
+	if (optind == argc || (list && !out))
+		goto usage;
+
+	for (; optind < argc; optind++)
+		parse_file(argv[optind]);
+	if (!nr_remotes)
+		die("no usable remote found\n");
+	write_keymap(out);
+	if (list)
+		list_keys();
+	fprintf(stderr, "%u remotes, %u keys\n", nr_remotes, nr_keys);
+	return 0;
+
+usage:
+	fprintf(stderr, "usage: %s [-o keymap.bin [-l]] lircd.conf...\n", argv[0]);
+	return 2;
+}
@@ -16,193 +16,2498 @@
 #include <linux/dma-mapping.h>
 #include <linux/mailbox_client.h>
 #include <soc/bcm2835/raspberrypi-firmware.h>
+#include <dt-bindings/power/raspberrypi-power.h>
 #include <linux/timer.h>
-#include <linux/workqueue.h>
+#include <linux/kthread.h>
+#include <linux/sched.h>
 #include <linux/slab.h>
-#define secs_to_jiffies(i) (msecs_to_jiffies((i)*1000))
-#define interval 2
+#include <linux/interrupt.h>
+#include <linux/moduleparam.h>
+#include <linux/mutex.h>
+#include <linux/firmware.h>
+#include <linux/hashtable.h>
+#include <linux/jhash.h>
+#include <linux/rcupdate.h>
+#include <linux/poll.h>
+#include <linux/crc32.h>
+#include <linux/debugfs.h>
+#include <linux/platform_device.h>
+#include <linux/of.h>
+#include <linux/of_gpio.h>
+#include <linux/idr.h>
+#if IS_ENABLED(CONFIG_DRM)
+#include <drm/drmP.h>
+#include <drm/drm_crtc.h>
+#include <linux/net.h>
+#include <linux/netlink.h>
+#include <linux/signal.h>
+#include <net/sock.h>
+#endif
+#if IS_REACHABLE(CONFIG_MEDIA_CEC) || IS_REACHABLE(CONFIG_CEC_CORE)
+#define HDMI_RPI_CEC
+#include <media/cec.h>
+#endif
+#include "lirc_rpi.h"
+#include "hdmi-rpi.h"
 
-static void work_handler(struct work_struct *work);
-struct workqueue_struct *wq;
-struct work_data{
-	struct work_struct work;
-	int data;
-};
-struct miscdevice;
-static int hdmi_pin;
+/*
+ * Hotplug GPIO interrupt. The pin bounces while the plug is inserted,
+ * so every edge pushes hpd_work back by the settle time and the work
+ * reports the level it settled on: debounce_ms for a sink arriving,
+ * disconnect_ms for one going away, which is longer so that a loose
+ * cable dropping out for a moment is not reported at all. Without an
+ * interrupt the module falls back to adaptive polling, see below.
+ *
+ * What still gets through is rate limited: at most flap_burst changes
+ * are reported per flap_window_ms, unless flap_burst is 0. Changes
+ * beyond that are counted as suppressed flaps and the line is looked at
+ * again when the window ends, so a cable that flaps for a while costs
+ * one report of where it ended up, or none if that is where it started.
+ *
+ * All hotplug handling, for every connector, runs on one kthread worker
+ * with a fixed RT priority and work items embedded in the connector, so
+ * the mailbox query is not stuck behind other work.
+ *
+ * hdmi_gpio and the settle times are the defaults for a connector, a
+ * device tree node overrides them.
+ */
 static unsigned int hdmi_gpio = 46;
-static int flag=1;
-static int past_46=0;
+module_param(hdmi_gpio, uint, S_IRUGO);
+MODULE_PARM_DESC(hdmi_gpio, "Hotplug GPIO without device tree, low while plugged in (default 46)");
+
+static unsigned int debounce_ms = 20;
+module_param(debounce_ms, uint, S_IRUGO);
+MODULE_PARM_DESC(debounce_ms, "Hotplug settle time for a sink arriving in ms (default 20)");
+
+static unsigned int disconnect_ms = 250;
+module_param(disconnect_ms, uint, S_IRUGO);
+MODULE_PARM_DESC(disconnect_ms, "Hotplug settle time for a sink going away in ms (default 250)");
+
+static unsigned int flap_burst = 4;
+module_param(flap_burst, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(flap_burst, "Hotplug changes reported per flap window, 0 for no limit (default 4)");
+
+static unsigned int flap_window_ms = 10000;
+module_param(flap_window_ms, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(flap_window_ms, "Flap window in ms (default 10000)");
+
+static int worker_prio = 50;
+module_param(worker_prio, int, S_IRUGO);
+MODULE_PARM_DESC(worker_prio, "SCHED_FIFO priority of the hotplug worker, 0 for SCHED_NORMAL (default 50)");
+
+/*
+ * Polling, for boards where the hotplug line has no interrupt. The
+ * period starts at poll_min_ms after every transition and doubles on
+ * each quiet poll up to poll_max_ms. The timer is deferrable and long
+ * periods are rounded to whole seconds, so an idle system is not woken
+ * just for us and our wakeups line up with other timers. The timer only
+ * queues poll_work: the line may sit on an I2C expander, which cannot
+ * be read from softirq context.
+ */
+static unsigned int poll_min_ms = 50;
+module_param(poll_min_ms, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(poll_min_ms, "Poll period right after a hotplug change in ms (default 50)");
+
+static unsigned int poll_max_ms = 10000;
+module_param(poll_max_ms, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(poll_max_ms, "Poll period once the line is stable in ms (default 10000)");
+
+/*
+ * IR binding
+ * On a disconnect that gets reported, transmit straight through
+ * lirc_rpi instead of leaving it to udev and hdmi_udev_script.sh. The
+ * uevent is still raised, but only as a notification. lirc_rpi is
+ * looked up with symbol_get() when needed, so it does not have to be
+ * loaded.
+ *
+ * This is the default now. Setups that still run hdmi_udev_script.sh
+ * from an older 90-hdmi.rules must replace the rule with the one
+ * shipped here, which no longer sends anything, and delete the script:
+ * POWER toggles, so its two blind sends would turn the projector back
+ * off, and the closed loop below would take them for hotplug changes
+ * it cannot explain.
+ * ir_action=none leaves power alone for those who want to keep their
+ * own handler.
+ *
+ * Power commands are closed loop: the hotplug state is the projector's
+ * acknowledgement. After each send we wait for the sink to come (on)
+ * or go (off), for the warm-up or cool-down below but at least
+ * ir_repeat_ms, and only then send again, at most ir_repeat times in
+ * all, then give up with HDMI_RPI_EV_POWER_TIMEOUT. A
+ * reported disconnect asks for the sink to come back, writing on or
+ * off to the power attribute asks for either.
+ */
+static char *ir_action = "default";
+module_param(ir_action, charp, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(ir_action, "On disconnect: default to send lirc_rpi's code, or none (default default)");
+
+static int ir_device;
+module_param(ir_device, int, S_IRUGO);
+MODULE_PARM_DESC(ir_device, "N of the /dev/lircN lirc_rpi instance to send with, rpi,lirc-device in DT (default 0)");
+
+static unsigned int ir_repeat = 2;
+module_param(ir_repeat, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(ir_repeat, "Times to send the code at most before giving up (default 2)");
+
+static unsigned int ir_repeat_ms = 2000;
+module_param(ir_repeat_ms, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(ir_repeat_ms, "Shortest wait for the sink to follow a power command in ms, the warm-up or cool-down time when longer (default 2000)");
+
+/*
+ * Projector model
+ * POWER is a toggle, and most projectors ignore it, or act on it
+ * late, while they warm up or cool down. Each connector keeps what the
+ * projector is probably doing, from hotplug changes and the timings
+ * below, and power commands that cannot do anything right now are
+ * held back: asking for on while warming or on, or off while cooling
+ * or off, is dropped, and a command against a warm-up or cool-down in
+ * progress waits for it to end instead of reversing it.
+ *
+ * A command that goes out starts the warm-up or cool-down itself, so a
+ * resend or the same request written again waits for it instead of
+ * toggling the projector back. If hotplug has not confirmed it by the
+ * end, the command did not land and the model falls back to what
+ * hotplug shows.
+ */
+static unsigned int warmup_ms = 30000;
+module_param(warmup_ms, uint, S_IRUGO);
+MODULE_PARM_DESC(warmup_ms, "Projector warm-up after it appears, rpi,warmup-ms in DT (default 30000)");
+
+static unsigned int cooldown_ms = 60000;
+module_param(cooldown_ms, uint, S_IRUGO);
+MODULE_PARM_DESC(cooldown_ms, "Projector cool-down after it goes away, rpi,cooldown-ms in DT (default 60000)");
+
+enum {
+	PROJ_OFF,
+	PROJ_WARMING,
+	PROJ_ON,
+	PROJ_COOLING,
+};
+
+static const char * const proj_names[] = {
+	[PROJ_OFF] = "off",
+	[PROJ_WARMING] = "warming",
+	[PROJ_ON] = "on",
+	[PROJ_COOLING] = "cooling",
+};
+
+/*
+ * CEC
+ * When the sink has a CEC physical address in its EDID and cec_device
+ * names a configured CEC adapter, power commands go out as <Image View
+ * On> plus <Active Source> or <Standby> instead of IR, and fall back to
+ * IR if the transmit fails. The adapter is found by opening its device
+ * node, any CEC framework adapter works, so the vivid driver's virtual
+ * adapters can stand in for real hardware. Its logical address is
+ * whatever userspace configured, e.g. cec-ctl --playback.
+ */
+static char *cec_device = "";
+module_param(cec_device, charp, S_IRUGO);
+MODULE_PARM_DESC(cec_device, "CEC adapter to send power commands with, e.g. /dev/cec0, rpi,cec-device in DT (default none)");
+
+#define EDID_NO_PA 0xffff
+
+static struct kthread_worker *hpd_worker;
+
+/* base block plus extensions kept from one sink */
+#define EDID_MAX_BLOCKS 4
+#define EDID_LENGTH 128
+
+/* fields decoded from the base block */
+struct hdmi_edid_id {
+	char vendor[4];		/* PNP ID, e.g. "EPS" */
+	u16 product;
+	u32 serial;
+	u8 week;
+	u16 year;
+	char name[14];		/* monitor name descriptor */
+	char serial_str[14];	/* serial string descriptor */
+};
+
+#define HDMI_CLASS_LEN 16
+
+/*
+ * Everything read from the sink that is plugged in, taken when it
+ * connects. The disconnect path only looks at this, by then the EDID
+ * may be gone. A snapshot never changes once published: every read
+ * builds a new one and the old one is freed after a grace period, so
+ * sysfs and the uevent path read it under rcu_read_lock() only.
+ */
+struct hdmi_edid_snapshot {
+	struct rcu_head rcu;
+	struct hdmi_edid_id id;
+	u32 crc;
+	bool projector;
+	char class[HDMI_CLASS_LEN];
+	int action;
+	unsigned int blocks;
+	u16 cec_pa;		/* EDID_NO_PA without an HDMI VSDB */
+	u8 edid[EDID_MAX_BLOCKS][EDID_LENGTH];
+};
+
+#define EVENT_RING_LEN 64	/* power of two */
+#define UEVENT_VARS 9
+
+struct hdmi_conn;
 
-struct edid_tag{
+/*
+ * EDID sources
+ * Where the EDID, and for some sources the hotplug state, comes from.
+ * Sources without ->connected use the hotplug GPIO, sources with
+ * ->events queue hpd_work themselves and are not polled. Picked per
+ * connector at probe time with rpi,edid-source or edid_source=, the
+ * detection, parsing and action code does not care which one it is.
+ * ->exit must leave nothing behind that can queue hpd_work.
+ */
+struct hdmi_edid_source {
+	const char *name;
+	int (*init)(struct hdmi_conn *conn);
+	void (*exit)(struct hdmi_conn *conn);
+	/* one 128 byte block, may sleep; needed without read_edid */
+	int (*read_block)(struct hdmi_conn *conn, unsigned int block, u8 *buf);
+	/*
+	 * all blocks at once, returns how many leading blocks were read;
+	 * used instead of read_block when present
+	 */
+	int (*read_edid)(struct hdmi_conn *conn, u8 (*edid)[EDID_LENGTH]);
+	/* 1 while a sink is connected, may sleep */
+	int (*connected)(struct hdmi_conn *conn);
+	bool events;
+};
+
+/*
+ * One per HDMI output, i.e. per rpi,hdmi-rpi device tree node, or the
+ * single fallback device without device tree. Each has its own
+ * /dev/hdmi_deviceN, hotplug line, EDID snapshot and event stream, so
+ * the outputs of a multi-display board are tracked independently.
+ */
+struct hdmi_conn {
+	struct device *dev;
+	int index;
+	char name[16];
+	struct miscdevice misc;
+	const struct hdmi_edid_source *src;
+
+	int gpio;
+	bool hpd_active_low;
+	unsigned int debounce_ms;
+	unsigned int disconnect_ms;
+	int ir_device;
+	int hpd_irq;
+
+	/* 1 while a sink is plugged in */
+	int hdmi_pin;
+	unsigned int hdmi_changes;
+	/* last settled level, only touched by hpd_work; starts out unplugged */
+	int hpd_settled;
+	/* rate limit, hpd_worker only */
+	unsigned long flap_window_start;
+	unsigned int flap_count;
+	unsigned int flaps_suppressed;
+	struct kthread_delayed_work hpd_work;
+
+	struct timer_list poll_timer;
+	struct kthread_work poll_work;
+	bool polling;
+	unsigned int poll_ms;
+	unsigned long poll_wakeups;
+	/* wakeups in the last full hour, counted from poll_hour_start */
+	unsigned long poll_hour_start, poll_hour_base, poll_last_hour;
+
+	/* NULL while nothing is known, only hpd_worker replaces it */
+	struct hdmi_edid_snapshot __rcu *edid_snap;
+	u32 last_edid_crc;
+
+	struct hdmi_rpi_event event_ring[EVENT_RING_LEN];
+	u32 event_head;
+	spinlock_t event_lock;
+	wait_queue_head_t event_wait;
+
+	/*
+	 * Power control. power_req hands a sysfs request to power_work,
+	 * the rest is only touched on hpd_worker. power_want is -1 while
+	 * nothing is pending.
+	 */
+	struct kthread_delayed_work power_work;
+	struct mutex power_lock;
+	bool dying;
+	int power_req;
+	int power_want;
+	unsigned int power_tries;
+	const char *power_result;
+
+	/* projector model, hpd_worker only */
+	struct kthread_delayed_work proj_work;
+	unsigned int warmup_ms, cooldown_ms;
+	bool proj_known;
+	int proj_state;
+	/* the warm-up or cool-down was started by a command, unconfirmed */
+	bool proj_by_cmd;
+	unsigned int proj_suppressed, proj_deferred;
+
+	/* last physical address seen, kept while the sink is away */
+	const char *cec_device;
+	struct file *cec_file;
+	u16 cec_pa;
+
+	/* KOBJ_CHANGE environment, only built on hpd_worker */
+	char uevent_buf[UEVENT_VARS][48];
+	/* SUBSYSTEM, the variables and the terminating NULL */
+	char *envp[UEVENT_VARS + 2];
+
+#if IS_ENABLED(CONFIG_DRM)
+	const char *drm_connector;
+	/* NULL while the KMS driver is unbound, under drm_lock */
+	struct device *drm_conn_dev;
+	struct mutex drm_lock;
+	struct class_interface drm_intf;
+	/* "DEVNAME=dri/card0" for drm_connector=card0-HDMI-A-1 */
+	char drm_devname[32];
+	struct list_head drm_node;
+#endif
+#ifdef CONFIG_DEBUG_FS
+	struct dentry *soft_dir;
+	struct mutex soft_lock;
+	u8 soft_edid[EDID_MAX_BLOCKS * EDID_LENGTH];
+	size_t soft_edid_len;
+	int soft_connected;
+#endif
+};
+
+static DEFINE_IDA(hdmi_ida);
+
+/* after a grace period, readers may still hold it */
+static void edid_snap_free(struct hdmi_edid_snapshot *snap){
+	if (snap)
+		kfree_rcu(snap, rcu);
+}
+
+/* returns the old snapshot, the caller frees it with edid_snap_free() */
+static struct hdmi_edid_snapshot *
+edid_snap_replace(struct hdmi_conn *conn, struct hdmi_edid_snapshot *snap){
+	struct hdmi_edid_snapshot *old;
+
+	old = rcu_dereference_protected(conn->edid_snap, 1);
+	rcu_assign_pointer(conn->edid_snap, snap);
+	return old;
+}
+
+static void my_timer_callback(unsigned long data);
+static void poll_work_fn(struct kthread_work *work);
+static void hpd_work_fn(struct kthread_work *work);
+static void power_work_fn(struct kthread_work *work);
+static void proj_work_fn(struct kthread_work *work);
+static int hdmi_hpd_irq_init(struct hdmi_conn *conn);
+
+static char *edid_source = "firmware";
+module_param(edid_source, charp, S_IRUGO);
+MODULE_PARM_DESC(edid_source, "firmware, drm or soft, rpi,edid-source in DT (default firmware)");
+
+#if IS_ENABLED(CONFIG_RASPBERRYPI_FIRMWARE)
+/*
+ * VideoCore firmware mailbox, the hotplug state comes from the GPIO.
+ * The firmware only reports the display it drives, so at most one
+ * connector can use this source.
+ */
+struct rpi_firmware *fw = NULL;
+
+/*
+ * One mailbox message carries every EDID block we keep plus the HDMI
+ * power domain state and the current mode, so a hotplug costs a single
+ * firmware round trip. The message is built in a buffer allocated once
+ * at load time; the firmware driver copies it into its own DMA memory.
+ */
+struct fw_edid_tag {
+	struct rpi_firmware_property_tag_header hdr;
 	u32 block_number;
 	u32 status;
-	unsigned char edid_block[128];
-}edid_tag1;
+	u8 edid_block[EDID_LENGTH];
+};
 
-static struct timer_list my_timer;
-static void my_timer_callback(unsigned long data);
+struct fw_u32x2_tag {
+	struct rpi_firmware_property_tag_header hdr;
+	u32 val[2];
+};
+
+struct fw_batch {
+	struct fw_edid_tag edid[EDID_MAX_BLOCKS];
+	struct fw_u32x2_tag power;	/* domain, state */
+	struct fw_u32x2_tag size;	/* width, height */
+	struct fw_u32x2_tag depth;	/* bits per pixel */
+	u32 end;
+};
+
+/* also tells whether a connector already uses the firmware */
+static struct fw_batch *fw_batch;
+static DEFINE_MUTEX(fw_batch_lock);
+
+/* last display state seen, for the display attribute */
+static DEFINE_MUTEX(fw_display_lock);
+static u32 fw_display_power, fw_display_width, fw_display_height;
+static u32 fw_display_depth;
+
+#define FW_TAG(_t, _tag) do {						\
+	(_t)->hdr.tag = (_tag);						\
+	(_t)->hdr.buf_size = sizeof(*(_t)) - sizeof((_t)->hdr);		\
+	(_t)->hdr.req_resp_size = 0;					\
+} while (0)
+
+static int fw_source_read_edid(struct hdmi_conn *conn,
+			       u8 (*edid)[EDID_LENGTH]){
+	struct fw_batch *b = fw_batch;
+	int i, error, n = 0;
+
+	memset(b, 0, sizeof(*b));
+	for (i = 0; i < EDID_MAX_BLOCKS; i++) {
+		FW_TAG(&b->edid[i], RPI_FIRMWARE_GET_EDID_BLOCK);
+		b->edid[i].hdr.req_resp_size = sizeof(u32);
+		b->edid[i].block_number = i;
+	}
+	FW_TAG(&b->power, RPI_FIRMWARE_GET_DOMAIN_STATE);
+	b->power.hdr.req_resp_size = sizeof(u32);
+	b->power.val[0] = RPI_POWER_DOMAIN_HDMI;
+	FW_TAG(&b->size, RPI_FIRMWARE_FRAMEBUFFER_GET_PHYSICAL_WIDTH_HEIGHT);
+	FW_TAG(&b->depth, RPI_FIRMWARE_FRAMEBUFFER_GET_DEPTH);
+	b->end = RPI_FIRMWARE_PROPERTY_END;
+
+	error = rpi_firmware_property_list(fw, b, sizeof(*b));
+	if (error)
+		return error;
+
+	/* blocks past the last extension come back with a status set */
+	while (n < EDID_MAX_BLOCKS && !b->edid[n].status) {
+		memcpy(edid[n], b->edid[n].edid_block, EDID_LENGTH);
+		n++;
+	}
+	pr_debug("%s: %d EDID blocks from the firmware\n", conn->name, n);
+	if (n)
+		print_hex_dump_debug("edid: ", DUMP_PREFIX_OFFSET, 16, 1,
+				     edid[0], EDID_LENGTH, true);
+
+	mutex_lock(&fw_display_lock);
+	fw_display_power = b->power.val[1];
+	fw_display_width = b->size.val[0];
+	fw_display_height = b->size.val[1];
+	fw_display_depth = b->depth.val[0];
+	mutex_unlock(&fw_display_lock);
+	return n;
+}
+
+static ssize_t display_show(struct device *dev,
+			    struct device_attribute *attr, char *buf){
+	ssize_t len;
+
+	mutex_lock(&fw_display_lock);
+	len = sprintf(buf, "power=%u mode=%ux%u depth=%u\n",
+		      fw_display_power, fw_display_width,
+		      fw_display_height, fw_display_depth);
+	mutex_unlock(&fw_display_lock);
+	return len;
+}
+static DEVICE_ATTR_RO(display);
+
+static int fw_source_init(struct hdmi_conn *conn){
+	int error = 0;
+
+	mutex_lock(&fw_batch_lock);
+	fw = rpi_firmware_get(NULL);
+	if (!fw)
+		error = -ENODEV;
+	else if (fw_batch)
+		error = -EBUSY;
+	else if (!(fw_batch = kmalloc(sizeof(*fw_batch), GFP_KERNEL)))
+		error = -ENOMEM;
+	mutex_unlock(&fw_batch_lock);
+	return error;
+}
+
+static void fw_source_exit(struct hdmi_conn *conn){
+	mutex_lock(&fw_batch_lock);
+	kfree(fw_batch);
+	fw_batch = NULL;
+	mutex_unlock(&fw_batch_lock);
+}
+
+static const struct hdmi_edid_source fw_source = {
+	.name = "firmware",
+	.init = fw_source_init,
+	.exit = fw_source_exit,
+	.read_edid = fw_source_read_edid,
+};
+#endif
+
+#if IS_ENABLED(CONFIG_DRM)
+/*
+ * A DRM connector, e.g. card0-HDMI-A-1. drm_class is not exported, so
+ * the class is borrowed from a throwaway device registered with
+ * drm_class_device_register().
+ *
+ * KMS drivers announce connector changes with a HOTPLUG=1 uevent on
+ * the card. One kthread listens for those on a kernel netlink socket
+ * for all DRM connectors and queues hpd_work on the ones of that card,
+ * which reprobes the connector through fill_modes so that status and
+ * EDID are current before they are looked at. Nothing is polled and no
+ * mailbox is involved.
+ *
+ * The connector belongs to the KMS driver and goes away when it
+ * unbinds. A class interface per connector hears about that, drops the
+ * device under drm_lock and reports the sink as gone; when a connector
+ * of that name shows up again it is picked up the same way.
+ */
+static char *drm_connector = "card0-HDMI-A-1";
+module_param(drm_connector, charp, S_IRUGO);
+MODULE_PARM_DESC(drm_connector, "Connector for edid_source=drm, rpi,drm-connector in DT (default card0-HDMI-A-1)");
+
+static struct socket *drm_uevent_sock;
+static struct task_struct *drm_uevent_task;
+static char drm_uevent_buf[2048];
+/* connectors the listener kicks, the listener runs while not empty */
+static LIST_HEAD(drm_conns);
+static DEFINE_SPINLOCK(drm_conns_lock);
+static DEFINE_MUTEX(drm_uevent_lock);
+/* recvmsg timeout, how long stopping the listener can take */
+#define DRM_UEVENT_TIMEOUT (HZ / 2)
+
+/* one uevent is "action@devpath" followed by NUL separated KEY=value */
+static bool drm_uevent_match(const char *buf, int len, const char *devname){
+	bool drm = false, hotplug = false, card = false;
+	const char *p;
+
+	for (p = buf; p < buf + len; p += strlen(p) + 1) {
+		if (!strcmp(p, "SUBSYSTEM=drm"))
+			drm = true;
+		else if (!strcmp(p, "HOTPLUG=1"))
+			hotplug = true;
+		else if (!strcmp(p, devname))
+			card = true;
+	}
+	return drm && hotplug && card;
+}
+
+static int drm_uevent_thread(void *data){
+	struct msghdr msg = {};
+	struct hdmi_conn *conn;
+	struct kvec iov;
+	int len;
+
+	/* recvmsg times out, kthread_stop() alone does not wake it */
+	while (!kthread_should_stop()) {
+		iov.iov_base = drm_uevent_buf;
+		iov.iov_len = sizeof(drm_uevent_buf) - 1;
+		len = kernel_recvmsg(drm_uevent_sock, &msg, &iov, 1,
+				     iov.iov_len, 0);
+		if (len < 0)
+			continue;
+		drm_uevent_buf[len] = '\0';
+		spin_lock(&drm_conns_lock);
+		list_for_each_entry(conn, &drm_conns, drm_node)
+			if (drm_uevent_match(drm_uevent_buf, len,
+					     conn->drm_devname))
+				kthread_mod_delayed_work(hpd_worker,
+							 &conn->hpd_work, 0);
+		spin_unlock(&drm_conns_lock);
+	}
+	return 0;
+}
+
+static int drm_uevent_start(void){
+	struct sockaddr_nl addr = {
+		.nl_family = AF_NETLINK,
+		.nl_groups = 1,		/* kernel uevents, not udev's */
+	};
+	int error;
+
+	error = sock_create_kern(&init_net, PF_NETLINK, SOCK_DGRAM,
+				 NETLINK_KOBJECT_UEVENT, &drm_uevent_sock);
+	if (error)
+		return error;
+	error = kernel_bind(drm_uevent_sock, (struct sockaddr *)&addr,
+			    sizeof(addr));
+	if (error)
+		goto fail;
+	drm_uevent_sock->sk->sk_rcvtimeo = DRM_UEVENT_TIMEOUT;
+	drm_uevent_task = kthread_run(drm_uevent_thread, NULL, "hdmi-drm-uevent");
+	if (IS_ERR(drm_uevent_task)) {
+		error = PTR_ERR(drm_uevent_task);
+		goto fail;
+	}
+	return 0;
+
+fail:
+	sock_release(drm_uevent_sock);
+	return error;
+}
+
+static void drm_uevent_stop(void){
+	kthread_stop(drm_uevent_task);
+	sock_release(drm_uevent_sock);
+}
+
+static void drm_probe_release(struct device *dev){
+	kfree(dev);
+}
+
+/* called with the DRM class mutex held, for every device of the class */
+static int drm_conn_add_dev(struct device *dev, struct class_interface *intf){
+	struct hdmi_conn *conn = container_of(intf, struct hdmi_conn,
+					      drm_intf);
+
+	if (strcmp(dev_name(dev), conn->drm_connector))
+		return 0;
+	mutex_lock(&conn->drm_lock);
+	if (!conn->drm_conn_dev)
+		conn->drm_conn_dev = get_device(dev);
+	mutex_unlock(&conn->drm_lock);
+	kthread_mod_delayed_work(hpd_worker, &conn->hpd_work, 0);
+	return 0;
+}
+
+/* before the KMS driver frees the connector behind dev */
+static void drm_conn_remove_dev(struct device *dev,
+				struct class_interface *intf){
+	struct hdmi_conn *conn = container_of(intf, struct hdmi_conn,
+					      drm_intf);
+
+	mutex_lock(&conn->drm_lock);
+	if (conn->drm_conn_dev != dev) {
+		mutex_unlock(&conn->drm_lock);
+		return;
+	}
+	conn->drm_conn_dev = NULL;
+	mutex_unlock(&conn->drm_lock);
+	put_device(dev);
+	pr_info("%s: DRM connector %s went away\n", conn->name,
+		conn->drm_connector);
+	kthread_mod_delayed_work(hpd_worker, &conn->hpd_work, 0);
+}
+
+static int drm_source_init(struct hdmi_conn *conn){
+	struct device *probe;
+	struct class *drm_cls;
+	int error = 0;
+
+	probe = kzalloc(sizeof(*probe), GFP_KERNEL);
+	if (!probe)
+		return -ENOMEM;
+	probe->release = drm_probe_release;
+	dev_set_name(probe, "hdmi-rpi-probe-%d", conn->index);
+	error = drm_class_device_register(probe);
+	if (error) {
+		put_device(probe);
+		return error;
+	}
+	drm_cls = probe->class;
+	drm_class_device_unregister(probe);
+
+	/* add_dev picks up the connector if it is already there */
+	mutex_init(&conn->drm_lock);
+	conn->drm_intf.class = drm_cls;
+	conn->drm_intf.add_dev = drm_conn_add_dev;
+	conn->drm_intf.remove_dev = drm_conn_remove_dev;
+	error = class_interface_register(&conn->drm_intf);
+	if (error)
+		return error;
+	if (!conn->drm_conn_dev) {
+		pr_err("no DRM connector %s\n", conn->drm_connector);
+		class_interface_unregister(&conn->drm_intf);
+		return -ENODEV;
+	}
+	snprintf(conn->drm_devname, sizeof(conn->drm_devname),
+		 "DEVNAME=dri/%.*s", (int)strcspn(conn->drm_connector, "-"),
+		 conn->drm_connector);
+
+	mutex_lock(&drm_uevent_lock);
+	if (list_empty(&drm_conns))
+		error = drm_uevent_start();
+	if (!error) {
+		spin_lock(&drm_conns_lock);
+		list_add_tail(&conn->drm_node, &drm_conns);
+		spin_unlock(&drm_conns_lock);
+	}
+	mutex_unlock(&drm_uevent_lock);
+	if (error)
+		class_interface_unregister(&conn->drm_intf);
+	return error;
+}
+
+static void drm_source_exit(struct hdmi_conn *conn){
+	mutex_lock(&drm_uevent_lock);
+	spin_lock(&drm_conns_lock);
+	list_del(&conn->drm_node);
+	spin_unlock(&drm_conns_lock);
+	if (list_empty(&drm_conns))
+		drm_uevent_stop();
+	mutex_unlock(&drm_uevent_lock);
+	/* drops the connector through remove_dev */
+	class_interface_unregister(&conn->drm_intf);
+	/* a uevent or remove_dev may have queued it */
+	kthread_cancel_delayed_work_sync(&conn->hpd_work);
+}
+
+static int drm_source_read_block(struct hdmi_conn *conn, unsigned int block,
+				 u8 *buf){
+	struct drm_connector *connector;
+	struct drm_property_blob *blob;
+	struct drm_device *ddev;
+	int error = -ENODATA;
+
+	mutex_lock(&conn->drm_lock);
+	if (!conn->drm_conn_dev) {
+		mutex_unlock(&conn->drm_lock);
+		return -ENODEV;
+	}
+	connector = dev_get_drvdata(conn->drm_conn_dev);
+	ddev = connector->dev;
+	drm_modeset_lock(&ddev->mode_config.connection_mutex, NULL);
+	blob = connector->edid_blob_ptr;
+	if (blob && blob->length >= (block + 1) * EDID_LENGTH) {
+		memcpy(buf, blob->data + block * EDID_LENGTH, EDID_LENGTH);
+		error = 0;
+	}
+	drm_modeset_unlock(&ddev->mode_config.connection_mutex);
+	mutex_unlock(&conn->drm_lock);
+	return error;
+}
+
+/*
+ * Reprobes like a GETCONNECTOR ioctl would, this refreshes the EDID
+ * too. Without a KMS driver there is no sink as far as we can tell.
+ */
+static int drm_source_connected(struct hdmi_conn *conn){
+	struct drm_connector *connector;
+	struct drm_device *ddev;
+	int connected = 0;
+
+	mutex_lock(&conn->drm_lock);
+	if (conn->drm_conn_dev) {
+		connector = dev_get_drvdata(conn->drm_conn_dev);
+		ddev = connector->dev;
+		mutex_lock(&ddev->mode_config.mutex);
+		connector->funcs->fill_modes(connector,
+					     ddev->mode_config.max_width,
+					     ddev->mode_config.max_height);
+		mutex_unlock(&ddev->mode_config.mutex);
+		connected = READ_ONCE(connector->status) ==
+			    connector_status_connected;
+	}
+	mutex_unlock(&conn->drm_lock);
+	return connected;
+}
+
+static const struct hdmi_edid_source drm_source = {
+	.name = "drm",
+	.init = drm_source_init,
+	.exit = drm_source_exit,
+	.read_block = drm_source_read_block,
+	.connected = drm_source_connected,
+	.events = true,
+};
+#endif
+
+#ifdef CONFIG_DEBUG_FS
+/*
+ * Software source for testing off the board. Every connector using it
+ * gets a hdmi-rpi/<device name> directory in debugfs. The EDID blob is
+ * written to its edid file and writing 1 or 0 to hotplug plugs or
+ * unplugs it, which runs the normal hotplug path.
+ */
+static struct dentry *soft_root;
+
+static ssize_t soft_edid_read(struct file *file, char __user *buf,
+			      size_t count, loff_t *ppos){
+	struct hdmi_conn *conn = file->private_data;
+	ssize_t len;
+
+	mutex_lock(&conn->soft_lock);
+	len = simple_read_from_buffer(buf, count, ppos, conn->soft_edid,
+				      conn->soft_edid_len);
+	mutex_unlock(&conn->soft_lock);
+	return len;
+}
+
+/* a write from offset 0 replaces the blob */
+static ssize_t soft_edid_write(struct file *file, const char __user *buf,
+			       size_t count, loff_t *ppos){
+	struct hdmi_conn *conn = file->private_data;
+	ssize_t len;
+
+	mutex_lock(&conn->soft_lock);
+	if (*ppos == 0)
+		conn->soft_edid_len = 0;
+	len = simple_write_to_buffer(conn->soft_edid,
+				     sizeof(conn->soft_edid), ppos,
+				     buf, count);
+	if (len > 0)
+		conn->soft_edid_len = max_t(size_t, conn->soft_edid_len,
+					    *ppos);
+	mutex_unlock(&conn->soft_lock);
+	return len;
+}
+
+static const struct file_operations soft_edid_fops = {
+	.owner = THIS_MODULE,
+	.open = simple_open,
+	.read = soft_edid_read,
+	.write = soft_edid_write,
+	.llseek = default_llseek,
+};
+
+static int soft_hotplug_get(void *data, u64 *val){
+	struct hdmi_conn *conn = data;
+
+	*val = READ_ONCE(conn->soft_connected);
+	return 0;
+}
+
+static int soft_hotplug_set(void *data, u64 val){
+	struct hdmi_conn *conn = data;
+
+	WRITE_ONCE(conn->soft_connected, !!val);
+	kthread_mod_delayed_work(hpd_worker, &conn->hpd_work, 0);
+	return 0;
+}
+DEFINE_SIMPLE_ATTRIBUTE(soft_hotplug_fops, soft_hotplug_get,
+			soft_hotplug_set, "%llu\n");
+
+static int soft_source_init(struct hdmi_conn *conn){
+	if (IS_ERR_OR_NULL(soft_root))
+		return -ENODEV;
+	mutex_init(&conn->soft_lock);
+	conn->soft_dir = debugfs_create_dir(conn->name, soft_root);
+	if (IS_ERR_OR_NULL(conn->soft_dir))
+		return -ENODEV;
+	debugfs_create_file("edid", S_IRUSR | S_IWUSR, conn->soft_dir, conn,
+			    &soft_edid_fops);
+	debugfs_create_file("hotplug", S_IRUSR | S_IWUSR, conn->soft_dir,
+			    conn, &soft_hotplug_fops);
+	return 0;
+}
+
+static void soft_source_exit(struct hdmi_conn *conn){
+	debugfs_remove_recursive(conn->soft_dir);
+	/* a hotplug write may have queued it until the files went away */
+	kthread_cancel_delayed_work_sync(&conn->hpd_work);
+}
+
+static int soft_source_read_block(struct hdmi_conn *conn, unsigned int block,
+				  u8 *buf){
+	int error = -ENODATA;
+
+	mutex_lock(&conn->soft_lock);
+	if (conn->soft_edid_len >= (block + 1) * EDID_LENGTH) {
+		memcpy(buf, conn->soft_edid + block * EDID_LENGTH,
+		       EDID_LENGTH);
+		error = 0;
+	}
+	mutex_unlock(&conn->soft_lock);
+	return error;
+}
+
+static int soft_source_connected(struct hdmi_conn *conn){
+	return READ_ONCE(conn->soft_connected);
+}
+
+static const struct hdmi_edid_source soft_source = {
+	.name = "soft",
+	.init = soft_source_init,
+	.exit = soft_source_exit,
+	.read_block = soft_source_read_block,
+	.connected = soft_source_connected,
+	.events = true,
+};
+#endif
+
+static const struct hdmi_edid_source * const edid_sources[] = {
+#if IS_ENABLED(CONFIG_RASPBERRYPI_FIRMWARE)
+	&fw_source,
+#endif
+#if IS_ENABLED(CONFIG_DRM)
+	&drm_source,
+#endif
+#ifdef CONFIG_DEBUG_FS
+	&soft_source,
+#endif
+};
+
+/*
+ * hotplug level in GPIO terms: 1 unplugged, 0 plugged in. Sleeps when
+ * the GPIO does, the IRQ is then threaded, see hdmi_hpd_irq_init().
+ */
+static int hdmi_hpd_level(struct hdmi_conn *conn){
+	int level;
+
+	if (conn->src->connected)
+		return !conn->src->connected(conn);
+	if (gpio_cansleep(conn->gpio))
+		level = gpio_get_value_cansleep(conn->gpio);
+	else
+		level = gpio_get_value(conn->gpio);
+	return conn->hpd_active_low ? level : !level;
+}
+
+/*
+ * EDID parsing
+ * Every block must sum to zero, a short or torn read fails the checksum
+ * and is rejected as a whole instead of being misclassified.
+ */
+static const u8 edid_header[8] = { 0x00, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0x00 };
+
+static bool edid_block_valid(const u8 *block){
+	u8 sum = 0;
+	int i;
+
+	for (i = 0; i < EDID_LENGTH; i++)
+		sum += block[i];
+	return sum == 0;
+}
+
+/* descriptor text ends on a newline and is padded with spaces */
+static void edid_copy_text(char *dst, const u8 *src){
+	int i;
+
+	for (i = 0; i < 13 && src[i] != 0x0a; i++)
+		dst[i] = (src[i] >= 0x20 && src[i] < 0x7f) ? src[i] : '?';
+	while (i > 0 && dst[i - 1] == ' ')
+		i--;
+	dst[i] = '\0';
+}
+
+static int edid_parse(const u8 *edid, struct hdmi_edid_id *id){
+	u16 pnp;
+	int i;
+
+	if (memcmp(edid, edid_header, sizeof(edid_header)))
+		return -EINVAL;
+
+	memset(id, 0, sizeof(*id));
+	/* three 5 bit letters, big endian, 'A' is 1 */
+	pnp = (edid[8] << 8) | edid[9];
+	id->vendor[0] = '@' + ((pnp >> 10) & 0x1f);
+	id->vendor[1] = '@' + ((pnp >> 5) & 0x1f);
+	id->vendor[2] = '@' + (pnp & 0x1f);
+	id->product = edid[10] | (edid[11] << 8);
+	id->serial = edid[12] | (edid[13] << 8) | (edid[14] << 16) |
+		     (edid[15] << 24);
+	id->week = edid[16];
+	id->year = 1990 + edid[17];
+
+	/* four 18 byte descriptors, display descriptors start with 0 0 */
+	for (i = 54; i <= 108; i += 18) {
+		const u8 *d = &edid[i];
+
+		if (d[0] || d[1])
+			continue;
+		if (d[3] == 0xfc)
+			edid_copy_text(id->name, &d[5]);
+		else if (d[3] == 0xff)
+			edid_copy_text(id->serial_str, &d[5]);
+	}
+	return 0;
+}
+
+/*
+ * Source physical address from the HDMI vendor specific data block
+ * (IEEE OUI 00-0C-03) of a CEA-861 extension, EDID_NO_PA if none.
+ */
+static u16 edid_cec_pa(u8 (*edid)[EDID_LENGTH], unsigned int blocks){
+	unsigned int b, i, len, end;
+
+	for (b = 1; b < blocks; b++) {
+		const u8 *x = edid[b];
+
+		if (x[0] != 0x02 || x[1] < 3)
+			continue;
+		/* data blocks run from byte 4 up to the DTD offset */
+		end = min_t(unsigned int, x[2], EDID_LENGTH - 1);
+		for (i = 4; i < end; i += len + 1) {
+			len = x[i] & 0x1f;
+			if (i + len >= end)
+				break;
+			if ((x[i] >> 5) == 3 && len >= 5 && x[i + 1] == 0x03 &&
+			    x[i + 2] == 0x0c && x[i + 3] == 0x00)
+				return x[i + 4] << 8 | x[i + 5];
+		}
+	}
+	return EDID_NO_PA;
+}
+
+/* reads block 0 and every extension it announces, sleeps */
+static int hdmi_read_edid(struct hdmi_conn *conn, u8 (*edid)[EDID_LENGTH],
+			  unsigned int *nblocks){
+	const struct hdmi_edid_source *src = conn->src;
+	unsigned int b, count = 1;
+	int error, avail = EDID_MAX_BLOCKS;
+
+	if (src->read_edid) {
+		avail = src->read_edid(conn, edid);
+		if (avail < 0)
+			return avail;
+	}
+
+	for (b = 0; b < count; b++) {
+		if (!src->read_edid) {
+			error = src->read_block(conn, b, edid[b]);
+			if (error)
+				return error;
+		} else if ((int)b >= avail) {
+			return -EIO;
+		}
+		if (!edid_block_valid(edid[b]))
+			return -EBADMSG;
+		if (b == 0) {
+			count = 1 + edid[0][126];
+			if (count > EDID_MAX_BLOCKS) {
+				pr_info("sink has %u blocks, keeping %d\n",
+					count, EDID_MAX_BLOCKS);
+				count = EDID_MAX_BLOCKS;
+			}
+		}
+	}
+	*nblocks = count;
+	return 0;
+}
+
+/*
+ * Sink table
+ * Maps vendor + product (and optionally serial) to a device class and
+ * what to do when that sink goes away. One rule per line:
+ *
+ *	<vendor> <product> <serial|*> <class> <notify|none>
+ *	EPS 0x0a1b * projector notify
+ *
+ * The table is immutable once published. Loading a new one builds a
+ * complete copy and swaps the pointer, hotplug lookups run under
+ * rcu_read_lock() and never wait for a reload. Sinks that match no rule
+ * fall back to the byte 99 heuristic. All connectors share one table,
+ * the sink_table attribute of any of them replaces it.
+ */
+enum {
+	HDMI_ACTION_NOTIFY,	/* raise the uevent on disconnect */
+	HDMI_ACTION_NONE,
+};
+
+static const char * const hdmi_action_names[] = {
+	[HDMI_ACTION_NOTIFY] = "notify",
+	[HDMI_ACTION_NONE] = "none",
+};
+
+#define SINK_TABLE_BITS 6
+#define SINK_TABLE_MAX 256
+
+struct hdmi_sink_rule {
+	struct hlist_node node;
+	char vendor[4];
+	u16 product;
+	bool any_serial;
+	u32 serial;
+	char class[HDMI_CLASS_LEN];
+	int action;
+};
+
+struct hdmi_sink_table {
+	struct rcu_head rcu;
+	unsigned int count;
+	DECLARE_HASHTABLE(buckets, SINK_TABLE_BITS);
+	struct hdmi_sink_rule rules[];
+};
+
+static struct hdmi_sink_table __rcu *sink_table;
+static DEFINE_MUTEX(sink_table_lock);
+
+static char *sink_table_fw;
+module_param(sink_table_fw, charp, S_IRUGO);
+MODULE_PARM_DESC(sink_table_fw, "Sink table loaded with request_firmware() at load time");
+
+static u32 sink_key(const char *vendor, u16 product){
+	return jhash_2words(vendor[0] << 16 | vendor[1] << 8 | vendor[2],
+			    product, 0);
+}
+
+static int sink_parse_line(char *line, struct hdmi_sink_rule *r){
+	char vendor[4], serial[12], class[HDMI_CLASS_LEN], action[8];
+	unsigned int product;
+	int i;
+
+	if (sscanf(line, "%3s %x %11s %15s %7s", vendor, &product, serial,
+		   class, action) != 5 || strlen(vendor) != 3 ||
+	    product > 0xffff)
+		return -EINVAL;
+
+	memcpy(r->vendor, vendor, sizeof(r->vendor));
+	r->product = product;
+	r->any_serial = !strcmp(serial, "*");
+	if (!r->any_serial && kstrtou32(serial, 0, &r->serial))
+		return -EINVAL;
+	strlcpy(r->class, class, sizeof(r->class));
+	for (i = 0; i < ARRAY_SIZE(hdmi_action_names); i++)
+		if (!strcmp(action, hdmi_action_names[i]))
+			break;
+	if (i == ARRAY_SIZE(hdmi_action_names))
+		return -EINVAL;
+	r->action = i;
+	return 0;
+}
+
+/* builds a complete table off to the side, NULL for an empty one */
+static struct hdmi_sink_table *sink_table_build(const char *text, size_t len){
+	struct hdmi_sink_table *t;
+	char *buf, *pos, *line;
+	unsigned int lineno = 0;
+	int error;
+
+	buf = kmalloc(len + 1, GFP_KERNEL);
+	if (!buf)
+		return ERR_PTR(-ENOMEM);
+	memcpy(buf, text, len);
+	buf[len] = '\0';
+	t = kzalloc(sizeof(*t) + SINK_TABLE_MAX * sizeof(t->rules[0]),
+		    GFP_KERNEL);
+	if (!t) {
+		kfree(buf);
+		return ERR_PTR(-ENOMEM);
+	}
+	hash_init(t->buckets);
+
+	pos = buf;
+	while ((line = strsep(&pos, "\n")) != NULL) {
+		struct hdmi_sink_rule *r = &t->rules[t->count];
+
+		lineno++;
+		line = strim(line);
+		if (!*line || *line == '#')
+			continue;
+		if (t->count == SINK_TABLE_MAX) {
+			error = -E2BIG;
+			goto fail;
+		}
+		error = sink_parse_line(line, r);
+		if (error) {
+			pr_err("sink table line %u: \"%s\"\n", lineno, line);
+			goto fail;
+		}
+		hash_add(t->buckets, &r->node, sink_key(r->vendor, r->product));
+		t->count++;
+	}
+	kfree(buf);
+	if (!t->count) {
+		kfree(t);
+		return NULL;
+	}
+	return t;
 
-static void get_projector_id(struct device_node *fwr, struct rpi_firmware *fw){
-	
+fail:
+	kfree(buf);
+	kfree(t);
+	return ERR_PTR(error);
+}
+
+static int sink_table_load(const char *text, size_t len){
+	struct hdmi_sink_table *t, *old;
+
+	t = sink_table_build(text, len);
+	if (IS_ERR(t))
+		return PTR_ERR(t);
+
+	mutex_lock(&sink_table_lock);
+	old = rcu_dereference_protected(sink_table,
+					lockdep_is_held(&sink_table_lock));
+	rcu_assign_pointer(sink_table, t);
+	mutex_unlock(&sink_table_lock);
+	if (old)
+		kfree_rcu(old, rcu);
+	pr_info("sink table: %u rules\n", t ? t->count : 0);
+	return 0;
+}
+
+/* exact serial beats a wildcard, returns false when nothing matched */
+static bool sink_lookup(const struct hdmi_edid_id *id, char *class, int *action){
+	struct hdmi_sink_table *t;
+	struct hdmi_sink_rule *r, *match = NULL;
+	bool found = false;
+
+	rcu_read_lock();
+	t = rcu_dereference(sink_table);
+	if (t) {
+		hash_for_each_possible_rcu(t->buckets, r, node,
+					   sink_key(id->vendor, id->product)) {
+			if (memcmp(r->vendor, id->vendor, 3) ||
+			    r->product != id->product)
+				continue;
+			if (!r->any_serial && r->serial == id->serial) {
+				match = r;
+				break;
+			}
+			if (r->any_serial && !match)
+				match = r;
+		}
+	}
+	if (match) {
+		strlcpy(class, match->class, HDMI_CLASS_LEN);
+		*action = match->action;
+		found = true;
+	}
+	rcu_read_unlock();
+	return found;
+}
+
+static ssize_t sink_table_show(struct device *dev,
+			       struct device_attribute *attr, char *buf){
+	struct hdmi_sink_table *t;
+	ssize_t len = 0;
+	unsigned int i;
+
+	rcu_read_lock();
+	t = rcu_dereference(sink_table);
+	for (i = 0; t && i < t->count; i++) {
+		struct hdmi_sink_rule *r = &t->rules[i];
+		char serial[12] = "*";
+
+		if (!r->any_serial)
+			snprintf(serial, sizeof(serial), "%u", r->serial);
+		len += scnprintf(buf + len, PAGE_SIZE - len,
+				 "%s 0x%04x %s %s %s\n", r->vendor,
+				 r->product, serial, r->class,
+				 hdmi_action_names[r->action]);
+	}
+	rcu_read_unlock();
+	return len;
+}
+
+static ssize_t sink_table_store(struct device *dev,
+				struct device_attribute *attr,
+				const char *buf, size_t count){
+	int error = sink_table_load(buf, count);
+
+	return error ? error : count;
+}
+static DEVICE_ATTR_RW(sink_table);
+
+static void sink_table_load_fw(struct device *dev){
+	const struct firmware *fwe;
 	int error;
-	printk(KERN_INFO "init\n");
-	printk(KERN_INFO "rpi_firmware_get := %p",fw);
-	/*edid_tag1.block_number = 0;
-	edid_tag1.status = 0;
-	for(error=0;error<128;error++)
-		edid_tag1.edid_block[error] = 0;*/
-	error = rpi_firmware_property(fw,RPI_FIRMWARE_GET_EDID_BLOCK,&edid_tag1,sizeof(edid_tag1));
-	printk(KERN_INFO "Block No:%x, status:%x, error:%d\n",edid_tag1.block_number,edid_tag1.status,error);
-	for(error=0;error<128;error++){
-		printk("%c",edid_tag1.edid_block[error]);
+
+	if (!sink_table_fw || !*sink_table_fw)
+		return;
+	error = request_firmware(&fwe, sink_table_fw, dev);
+	if (error) {
+		pr_err("sink table %s: %d\n", sink_table_fw, error);
+		return;
 	}
-	printk("\n");
-	printk("%c\n",edid_tag1.edid_block[99]);
+	error = sink_table_load(fwe->data, fwe->size);
+	if (error)
+		pr_err("sink table %s: %d\n", sink_table_fw, error);
+	release_firmware(fwe);
+}
+
+static void sink_table_free(void){
+	struct hdmi_sink_table *t;
+
+	t = rcu_dereference_protected(sink_table, 1);
+	RCU_INIT_POINTER(sink_table, NULL);
+	synchronize_rcu();
+	kfree(t);
+}
+
+/* sysfs attributes live on the misc device, whose drvdata is the misc */
+static struct hdmi_conn *to_hdmi_conn(struct device *dev){
+	struct miscdevice *misc = dev_get_drvdata(dev);
+
+	return container_of(misc, struct hdmi_conn, misc);
+}
+
+#define EDID_ID_ATTR(_name, _fmt, _field)				\
+static ssize_t _name##_show(struct device *dev,				\
+			    struct device_attribute *attr, char *buf)	\
+{									\
+	struct hdmi_conn *conn = to_hdmi_conn(dev);			\
+	struct hdmi_edid_snapshot *snap;				\
+	ssize_t len = -ENODATA;						\
+									\
+	rcu_read_lock();						\
+	snap = rcu_dereference(conn->edid_snap);			\
+	if (snap)							\
+		len = sprintf(buf, _fmt "\n", snap->id._field);	\
+	rcu_read_unlock();						\
+	return len;							\
+}									\
+static DEVICE_ATTR_RO(_name)
+
+EDID_ID_ATTR(vendor, "%s", vendor);
+EDID_ID_ATTR(product, "0x%04x", product);
+EDID_ID_ATTR(serial, "%u", serial);
+EDID_ID_ATTR(monitor_name, "%s", name);
+EDID_ID_ATTR(serial_string, "%s", serial_str);
+
+static ssize_t class_show(struct device *dev,
+			  struct device_attribute *attr, char *buf){
+	struct hdmi_conn *conn = to_hdmi_conn(dev);
+	struct hdmi_edid_snapshot *snap;
+	ssize_t len = -ENODATA;
+
+	rcu_read_lock();
+	snap = rcu_dereference(conn->edid_snap);
+	if (snap)
+		len = sprintf(buf, "%s %s\n", snap->class,
+			      hdmi_action_names[snap->action]);
+	rcu_read_unlock();
+	return len;
+}
+static DEVICE_ATTR_RO(class);
+
+static ssize_t manufactured_show(struct device *dev,
+				 struct device_attribute *attr, char *buf){
+	struct hdmi_conn *conn = to_hdmi_conn(dev);
+	struct hdmi_edid_snapshot *snap;
+	ssize_t len = -ENODATA;
+
+	rcu_read_lock();
+	snap = rcu_dereference(conn->edid_snap);
+	/* week 0xff means the year is the model year */
+	if (snap)
+		len = sprintf(buf, snap->id.week == 0xff ? "model %u\n" :
+			      "%u week %u\n", snap->id.year, snap->id.week);
+	rcu_read_unlock();
+	return len;
+}
+static DEVICE_ATTR_RO(manufactured);
+
+/* one line per extension block: index and tag, 0x02 is CEA-861 */
+static ssize_t extensions_show(struct device *dev,
+			       struct device_attribute *attr, char *buf){
+	struct hdmi_conn *conn = to_hdmi_conn(dev);
+	struct hdmi_edid_snapshot *snap;
+	ssize_t len = 0;
+	unsigned int b;
+
+	rcu_read_lock();
+	snap = rcu_dereference(conn->edid_snap);
+	if (!snap)
+		len = -ENODATA;
+	else
+		for (b = 1; b < snap->blocks; b++)
+			len += sprintf(buf + len, "%u 0x%02x\n", b,
+				       snap->edid[b][0]);
+	rcu_read_unlock();
+	return len;
 }
+static DEVICE_ATTR_RO(extensions);
+
+static ssize_t edid_read(struct file *filp, struct kobject *kobj,
+			 struct bin_attribute *attr, char *buf,
+			 loff_t off, size_t count){
+	struct hdmi_conn *conn = to_hdmi_conn(kobj_to_dev(kobj));
+	struct hdmi_edid_snapshot *snap;
+	ssize_t len = 0;
 
+	rcu_read_lock();
+	snap = rcu_dereference(conn->edid_snap);
+	if (snap)
+		len = memory_read_from_buffer(buf, count, &off, snap->edid,
+					      snap->blocks * EDID_LENGTH);
+	rcu_read_unlock();
+	return len;
+}
+static BIN_ATTR_RO(edid, EDID_MAX_BLOCKS * EDID_LENGTH);
 
+/* both call sysfs_notify() on every hotplug change, see hdmi_set_state() */
 static ssize_t read_hdmi_status (struct device *dev, struct device_attribute *attr,char *buf){
-	return sprintf(buf,"hdmi_status=%d\n",hdmi_pin);
+	return sprintf(buf,"hdmi_status=%d\n",READ_ONCE(to_hdmi_conn(dev)->hdmi_pin));
 }
-static ssize_t change_hdmi_status (struct device *dev, 
+static ssize_t change_hdmi_status (struct device *dev,
 						struct device_attribute *attr,char *buf){
-	//if(count)
-	//	errorurn sscanf(buf,"%d",&type);
-		return sprintf(buf,"hdmi_status=%d\n",hdmi_pin);	
+	return sprintf(buf,"hdmi_changes=%u\n",READ_ONCE(to_hdmi_conn(dev)->hdmi_changes));
 }
 static DEVICE_ATTR(read, S_IRUSR|S_IRGRP, read_hdmi_status, NULL);
 static DEVICE_ATTR(change, S_IRUSR|S_IRGRP, change_hdmi_status, NULL);
 
+/* per_hour is the count of the hour in progress until one has passed */
+static ssize_t poll_show(struct device *dev,
+			 struct device_attribute *attr, char *buf){
+	struct hdmi_conn *conn = to_hdmi_conn(dev);
+	unsigned long wakeups = READ_ONCE(conn->poll_wakeups);
+	unsigned long last = READ_ONCE(conn->poll_last_hour);
+
+	if (!conn->polling)
+		return sprintf(buf, "off\n");
+	if (time_before(jiffies, conn->poll_hour_start + 3600 * HZ) && !last)
+		last = wakeups - READ_ONCE(conn->poll_hour_base);
+	return sprintf(buf, "interval_ms=%u wakeups=%lu per_hour=%lu\n",
+		       READ_ONCE(conn->poll_ms), wakeups, last);
+}
+static DEVICE_ATTR_RO(poll);
+
+static ssize_t flaps_show(struct device *dev,
+			  struct device_attribute *attr, char *buf){
+	struct hdmi_conn *conn = to_hdmi_conn(dev);
+
+	return sprintf(buf, "suppressed=%u settle_ms=%u/%u limit=%u/%ums\n",
+		       READ_ONCE(conn->flaps_suppressed), conn->debounce_ms,
+		       conn->disconnect_ms, flap_burst, flap_window_ms);
+}
+static DEVICE_ATTR_RO(flaps);
+
+static const char * const power_names[] = { "off", "on" };
+
+/* idle or the state asked for, sends so far and how the last one ended */
+static ssize_t power_show(struct device *dev,
+			  struct device_attribute *attr, char *buf){
+	struct hdmi_conn *conn = to_hdmi_conn(dev);
+	int want = READ_ONCE(conn->power_want);
+
+	return sprintf(buf, "%s tries=%u/%u last=%s\n",
+		       want < 0 ? "idle" : power_names[want],
+		       READ_ONCE(conn->power_tries), ir_repeat,
+		       READ_ONCE(conn->power_result));
+}
+
+static ssize_t power_store(struct device *dev,
+			   struct device_attribute *attr,
+			   const char *buf, size_t count){
+	struct hdmi_conn *conn = to_hdmi_conn(dev);
+	int want, error = 0;
+
+	for (want = 0; want < ARRAY_SIZE(power_names); want++)
+		if (sysfs_streq(buf, power_names[want]))
+			break;
+	if (want == ARRAY_SIZE(power_names))
+		return -EINVAL;
+	mutex_lock(&conn->power_lock);
+	if (conn->dying) {
+		error = -ENODEV;
+	} else {
+		WRITE_ONCE(conn->power_req, want);
+		kthread_mod_delayed_work(hpd_worker, &conn->power_work, 0);
+	}
+	mutex_unlock(&conn->power_lock);
+	return error ? error : count;
+}
+static DEVICE_ATTR_RW(power);
+
+static ssize_t projector_show(struct device *dev,
+			      struct device_attribute *attr, char *buf){
+	struct hdmi_conn *conn = to_hdmi_conn(dev);
+
+	return sprintf(buf, "%s suppressed=%u deferred=%u\n",
+		       READ_ONCE(conn->proj_known) ?
+		       proj_names[READ_ONCE(conn->proj_state)] : "unknown",
+		       READ_ONCE(conn->proj_suppressed),
+		       READ_ONCE(conn->proj_deferred));
+}
+static DEVICE_ATTR_RO(projector);
+
+/* the sink's physical address and the adapter commands would go to */
+static ssize_t cec_show(struct device *dev,
+			struct device_attribute *attr, char *buf){
+	struct hdmi_conn *conn = to_hdmi_conn(dev);
+	u16 pa = READ_ONCE(conn->cec_pa);
+
+	if (pa == EDID_NO_PA)
+		return sprintf(buf, "none\n");
+	return sprintf(buf, "%x.%x.%x.%x %s\n", pa >> 12, (pa >> 8) & 0xf,
+		       (pa >> 4) & 0xf, pa & 0xf,
+		       *conn->cec_device ? conn->cec_device : "ir");
+}
+static DEVICE_ATTR_RO(cec);
+
 static struct attribute *dev_attrs[] = {
 	&dev_attr_read.attr,
 	&dev_attr_change.attr,
+	&dev_attr_poll.attr,
+	&dev_attr_flaps.attr,
+	&dev_attr_power.attr,
+	&dev_attr_projector.attr,
+	&dev_attr_cec.attr,
+	&dev_attr_vendor.attr,
+	&dev_attr_product.attr,
+	&dev_attr_serial.attr,
+	&dev_attr_manufactured.attr,
+	&dev_attr_monitor_name.attr,
+	&dev_attr_serial_string.attr,
+	&dev_attr_extensions.attr,
+	&dev_attr_class.attr,
+	&dev_attr_sink_table.attr,
+#if IS_ENABLED(CONFIG_RASPBERRYPI_FIRMWARE)
+	&dev_attr_display.attr,
+#endif
+	NULL
+};
+static struct bin_attribute *dev_bin_attrs[] = {
+	&bin_attr_edid,
 	NULL
 };
 static struct attribute_group dev_attr_group = {
-	.attrs = dev_attrs,NULL
+	.attrs = dev_attrs,
+	.bin_attrs = dev_bin_attrs,
 };
 static const struct attribute_group *dev_attr_groups[] = {
 	&dev_attr_group,
 	NULL
 };
-static struct miscdevice hdmi_dev = {
-	.name = "hdmi_device",
-	.minor = MISC_DYNAMIC_MINOR,
+/*
+ * Event stream
+ * Events go into a small per-connector ring once and every open file
+ * descriptor reads them through its own cursor. A reader that falls
+ * more than EVENT_RING_LEN behind gets HDMI_RPI_EV_OVERFLOW and
+ * continues with the oldest event still there, the hotplug path never
+ * waits for readers.
+ */
+struct hdmi_reader {
+	struct hdmi_conn *conn;
+	struct mutex lock;
+	u32 tail;
 };
-static char *envp[]={"SUBSYSTEM=HDMI",NULL};
 
-struct device_node *fwr = NULL;
-//	fw = of_find_compatible_node(NULL,);
-struct rpi_firmware *fw = NULL;
+/* id may be NULL when the sink is unknown */
+static u64 hdmi_queue_event(struct hdmi_conn *conn, u32 type,
+			    const struct hdmi_edid_id *id){
+	struct hdmi_rpi_event *ev;
+	u64 timestamp;
 
-static int __init module_start(void)
+	spin_lock(&conn->event_lock);
+	ev = &conn->event_ring[conn->event_head & (EVENT_RING_LEN - 1)];
+	memset(ev, 0, sizeof(*ev));
+	ev->timestamp = timestamp = ktime_get_ns();
+	ev->type = type;
+	ev->seq = conn->event_head;
+	if (id) {
+		memcpy(ev->vendor, id->vendor, sizeof(ev->vendor));
+		ev->product = id->product;
+		ev->serial = id->serial;
+		strlcpy(ev->name, id->name, sizeof(ev->name));
+	}
+	conn->event_head++;
+	spin_unlock(&conn->event_lock);
+	wake_up_interruptible(&conn->event_wait);
+	return timestamp;
+}
+
+static int hdmi_open(struct inode *inode, struct file *file){
+	/* misc_open() left our miscdevice here */
+	struct hdmi_conn *conn = container_of(file->private_data,
+					      struct hdmi_conn, misc);
+	struct hdmi_reader *rd;
+
+	rd = kzalloc(sizeof(*rd), GFP_KERNEL);
+	if (!rd)
+		return -ENOMEM;
+	rd->conn = conn;
+	mutex_init(&rd->lock);
+	/* only events from now on */
+	spin_lock(&conn->event_lock);
+	rd->tail = conn->event_head;
+	spin_unlock(&conn->event_lock);
+	file->private_data = rd;
+	return nonseekable_open(inode, file);
+}
+
+static int hdmi_release(struct inode *inode, struct file *file){
+	kfree(file->private_data);
+	return 0;
+}
+
+static ssize_t hdmi_read(struct file *file, char __user *buf,
+			 size_t count, loff_t *ppos){
+	struct hdmi_reader *rd = file->private_data;
+	struct hdmi_conn *conn = rd->conn;
+	struct hdmi_rpi_event ev;
+	size_t done = 0;
+	int error = 0;
+
+	if (count < sizeof(ev))
+		return -EINVAL;
+	if (mutex_lock_interruptible(&rd->lock))
+		return -ERESTARTSYS;
+
+	while (done + sizeof(ev) <= count) {
+		spin_lock(&conn->event_lock);
+		if (conn->event_head == rd->tail) {
+			spin_unlock(&conn->event_lock);
+			if (done)
+				break;
+			if (file->f_flags & O_NONBLOCK) {
+				error = -EAGAIN;
+				break;
+			}
+			error = wait_event_interruptible(conn->event_wait,
+					READ_ONCE(conn->event_head) != rd->tail);
+			if (error)
+				break;
+			continue;
+		}
+		if (conn->event_head - rd->tail > EVENT_RING_LEN) {
+			memset(&ev, 0, sizeof(ev));
+			ev.timestamp = ktime_get_ns();
+			ev.type = HDMI_RPI_EV_OVERFLOW;
+			ev.seq = rd->tail;
+			rd->tail = conn->event_head - EVENT_RING_LEN;
+		} else {
+			ev = conn->event_ring[rd->tail & (EVENT_RING_LEN - 1)];
+			rd->tail++;
+		}
+		spin_unlock(&conn->event_lock);
+
+		if (copy_to_user(buf + done, &ev, sizeof(ev))) {
+			error = -EFAULT;
+			break;
+		}
+		done += sizeof(ev);
+	}
+
+	mutex_unlock(&rd->lock);
+	return done ? done : error;
+}
+
+static unsigned int hdmi_poll(struct file *file, poll_table *wait){
+	struct hdmi_reader *rd = file->private_data;
+
+	poll_wait(file, &rd->conn->event_wait, wait);
+	if (READ_ONCE(rd->conn->event_head) != rd->tail)
+		return POLLIN | POLLRDNORM;
+	return 0;
+}
+
+static const struct file_operations hdmi_fops = {
+	.owner		= THIS_MODULE,
+	.open		= hdmi_open,
+	.release	= hdmi_release,
+	.read		= hdmi_read,
+	.poll		= hdmi_poll,
+	.llseek		= no_llseek,
+};
+
+/* hotplug state as seen by sysfs pollers and the event stream */
+static void hdmi_set_state(struct hdmi_conn *conn, int connected){
+	struct kobject *kobj = &conn->misc.this_device->kobj;
+
+	WRITE_ONCE(conn->hdmi_pin, connected);
+	WRITE_ONCE(conn->hdmi_changes, conn->hdmi_changes + 1);
+	sysfs_notify(kobj, NULL, "read");
+	sysfs_notify(kobj, NULL, "change");
+}
+/*
+ * KOBJ_CHANGE environment. SUBSYSTEM=HDMI stays first for the existing
+ * udev rule, the rest lets rules and logs tell sinks and connectors
+ * apart without asking the firmware again.
+ */
+static int hdmi_uevent(struct hdmi_conn *conn, const char *state,
+		       const struct hdmi_edid_id *id, const char *class,
+		       u32 edid_hash, u64 timestamp){
+	struct kobject *kobj = &conn->misc.this_device->kobj;
+	int n = 0;
+
+#define UEVENT_VAR(fmt, ...) \
+	snprintf(conn->uevent_buf[n], sizeof(conn->uevent_buf[n]), fmt, __VA_ARGS__); \
+	conn->envp[1 + n] = conn->uevent_buf[n]; \
+	n++
+
+	UEVENT_VAR("HDMI_STATE=%s", state);
+	UEVENT_VAR("HDMI_CONNECTOR=%s", conn->name);
+	UEVENT_VAR("HDMI_TIMESTAMP=%llu", (unsigned long long)timestamp);
+	if (id) {
+		UEVENT_VAR("HDMI_VENDOR=%s", id->vendor);
+		UEVENT_VAR("HDMI_PRODUCT=%04x", id->product);
+		UEVENT_VAR("HDMI_SERIAL=%u", id->serial);
+		UEVENT_VAR("HDMI_NAME=%s", id->name);
+		UEVENT_VAR("HDMI_CLASS=%s", class);
+		UEVENT_VAR("HDMI_EDID_HASH=%08x", edid_hash);
+	}
+#undef UEVENT_VAR
+	conn->envp[1 + n] = NULL;
+	return kobject_uevent_env(kobj, KOBJ_CHANGE, conn->envp);
+}
+
+/*
+ * Device tree
+ * One node per HDMI output:
+ *
+ *	hdmi-hotplug {
+ *		compatible = "rpi,hdmi-rpi";
+ *		hpd-gpios = <&gpio 46 GPIO_ACTIVE_LOW>;
+ *		debounce-ms = <20>;
+ *		rpi,disconnect-settle-ms = <250>;
+ *		rpi,edid-source = "firmware";	// or "drm", "soft"
+ *		rpi,drm-connector = "card0-HDMI-A-1";
+ *		rpi,lirc-device = <0>;
+ *		rpi,cec-device = "/dev/cec0";
+ *	};
+ *
+ * Everything but compatible is optional and falls back to the module
+ * parameter of the same meaning. The first output gets /dev/hdmi_device,
+ * the next ones /dev/hdmi_device1 and up.
+ */
+static const struct of_device_id hdmi_rpi_of_match[] = {
+	{ .compatible = "rpi,hdmi-rpi", },
+	{},
+};
+MODULE_DEVICE_TABLE(of, hdmi_rpi_of_match);
+
+static struct platform_device *hdmi_rpi_dev;
+static bool sink_table_loaded;
+
+static void hdmi_read_dt(struct hdmi_conn *conn, struct device_node *node,
+			 const char **source){
+	enum of_gpio_flags flags;
+	u32 value;
+	int gpio;
+
+	gpio = of_get_named_gpio_flags(node, "hpd-gpios", 0, &flags);
+	if (gpio_is_valid(gpio)) {
+		conn->gpio = gpio;
+		conn->hpd_active_low = flags & OF_GPIO_ACTIVE_LOW;
+	}
+	of_property_read_u32(node, "debounce-ms", &conn->debounce_ms);
+	of_property_read_u32(node, "rpi,disconnect-settle-ms",
+			     &conn->disconnect_ms);
+	of_property_read_u32(node, "rpi,warmup-ms", &conn->warmup_ms);
+	of_property_read_u32(node, "rpi,cooldown-ms", &conn->cooldown_ms);
+	of_property_read_string(node, "rpi,edid-source", source);
+#if IS_ENABLED(CONFIG_DRM)
+	of_property_read_string(node, "rpi,drm-connector",
+				&conn->drm_connector);
+#endif
+	if (!of_property_read_u32(node, "rpi,lirc-device", &value))
+		conn->ir_device = value;
+	of_property_read_string(node, "rpi,cec-device", &conn->cec_device);
+}
+
+static int hdmi_rpi_probe(struct platform_device *pdev)
 {
+	const char *source = edid_source;
+	struct hdmi_conn *conn;
 	int error = 0;
-	pr_info("\n");
-	
-	wq = create_workqueue("wq_test");
-	error = misc_register(&hdmi_dev);
-	if (error)
+	int i;
+
+	conn = devm_kzalloc(&pdev->dev, sizeof(*conn), GFP_KERNEL);
+	if (!conn)
+		return -ENOMEM;
+	conn->dev = &pdev->dev;
+
+	/* module parameters are the defaults, DT overrides them */
+	conn->gpio = hdmi_gpio;
+	conn->hpd_active_low = true;
+	conn->debounce_ms = debounce_ms;
+	conn->disconnect_ms = disconnect_ms;
+	conn->warmup_ms = warmup_ms;
+	conn->cooldown_ms = cooldown_ms;
+	conn->ir_device = ir_device;
+	conn->cec_device = cec_device;
+	conn->cec_pa = EDID_NO_PA;
+#if IS_ENABLED(CONFIG_DRM)
+	conn->drm_connector = drm_connector;
+#endif
+	if (pdev->dev.of_node)
+		hdmi_read_dt(conn, pdev->dev.of_node, &source);
+
+	for (i = 0; i < ARRAY_SIZE(edid_sources); i++)
+		if (!strcmp(source, edid_sources[i]->name))
+			conn->src = edid_sources[i];
+	if (!conn->src) {
+		pr_err("unknown edid_source %s\n", source);
+		return -EINVAL;
+	}
+
+	conn->index = ida_simple_get(&hdmi_ida, 0, 0, GFP_KERNEL);
+	if (conn->index < 0)
+		return conn->index;
+	/* the first one keeps the name the udev rule and scripts know */
+	if (conn->index)
+		snprintf(conn->name, sizeof(conn->name), "hdmi_device%d",
+			 conn->index);
+	else
+		strlcpy(conn->name, "hdmi_device", sizeof(conn->name));
+
+	conn->hpd_irq = -1;
+	conn->hpd_settled = 1;
+	conn->flap_window_start = jiffies;
+	spin_lock_init(&conn->event_lock);
+	init_waitqueue_head(&conn->event_wait);
+	conn->envp[0] = "SUBSYSTEM=HDMI";
+	kthread_init_delayed_work(&conn->hpd_work, hpd_work_fn);
+	kthread_init_delayed_work(&conn->power_work, power_work_fn);
+	mutex_init(&conn->power_lock);
+	conn->power_req = -1;
+	conn->power_want = -1;
+	conn->power_result = "none";
+	kthread_init_delayed_work(&conn->proj_work, proj_work_fn);
+	setup_deferrable_timer(&conn->poll_timer, my_timer_callback,
+			       (unsigned long)conn);
+	kthread_init_work(&conn->poll_work, poll_work_fn);
+
+	conn->misc.name = conn->name;
+	conn->misc.minor = MISC_DYNAMIC_MINOR;
+	conn->misc.fops = &hdmi_fops;
+	conn->misc.groups = dev_attr_groups;
+	conn->misc.parent = &pdev->dev;
+	platform_set_drvdata(pdev, conn);
+
+	error = misc_register(&conn->misc);
+	if (error) {
 		pr_err("error %d\n", error);
-	
-	struct device *dev = hdmi_dev.this_device;
+		goto exit_ida;
+	}
 
-	/*error = kobject_uevent_env(&dev->kobj,KOBJ_CHANGE,envp);
-	if (error){
-		kobject_put(&dev->kobj);
-		pr_err("No kobject_uevent %d\n", error);
-	}*/
+	error = conn->src->init ? conn->src->init(conn) : 0;
+	if (error) {
+		pr_err("%s: edid_source %s: %d\n", conn->name,
+		       conn->src->name, error);
+		goto exit_misc;
+	}
 
-	if(!gpio_is_valid(hdmi_gpio)){
-		printk(KERN_INFO "hdmi hotplug gpio invalid");
-		return -ENODEV;
+	if (!conn->src->connected) {
+		if (!gpio_is_valid(conn->gpio)) {
+			pr_err("%s: hotplug gpio invalid\n", conn->name);
+			error = -ENODEV;
+			goto exit_src;
+		}
+		error = gpio_request(conn->gpio, conn->name);
+		if (error)
+			goto exit_src;
+		gpio_direction_input(conn->gpio);
+		gpio_export(conn->gpio, false);
 	}
 
-	gpio_request(hdmi_gpio,"sysfs");
-	gpio_direction_input(hdmi_gpio);
-	gpio_export(hdmi_gpio,false);
-	past_46 = gpio_get_value(46);
-	
-	edid_tag1.block_number = 0;
-	edid_tag1.status = 0;
-	for(error=0;error<128;error++)
-		edid_tag1.edid_block[error] = 0;
-	fw = rpi_firmware_get(NULL);
-	//get_projector_id(fwr,fw);
-	
-	//get_projector_id(fwr,fw);
-	printk(KERN_INFO "detected device: %c\n",edid_tag1.edid_block[99]);
-	
-	
-	setup_timer(&my_timer,my_timer_callback,0);
-	error = mod_timer(&my_timer,secs_to_jiffies(interval));
-	if(error)
-		printk(KERN_INFO "timer error");
+	/* the table is shared, the first output loads it */
+	if (!sink_table_loaded) {
+		sink_table_loaded = true;
+		sink_table_load_fw(conn->misc.this_device);
+	}
+	/* picks up a sink that is already plugged in at load time */
+	kthread_queue_delayed_work(hpd_worker, &conn->hpd_work, 0);
 
-#if 0
-	error = device_create_file(dev,&dev_attr_read);
-	if (error){
-		put_device(dev);
-		pr_err("No Read device attribute Added%d\n", error);
+	error = conn->src->connected ? -ENXIO : hdmi_hpd_irq_init(conn);
+	if (conn->src->events) {
+		pr_info("%s: edid_source %s reports hotplug itself\n",
+			conn->name, conn->src->name);
+	} else if (error) {
+		pr_info("%s: no hotplug irq (%d), polling every %u..%ums\n",
+			conn->name, error, poll_min_ms, poll_max_ms);
+		conn->polling = true;
+		conn->poll_ms = poll_min_ms;
+		conn->poll_hour_start = jiffies;
+		mod_timer(&conn->poll_timer,
+			  jiffies + msecs_to_jiffies(conn->poll_ms));
+	} else {
+		pr_info("%s: hotplug gpio %d irq %d, settle %u/%ums\n",
+			conn->name, conn->gpio, conn->hpd_irq,
+			conn->debounce_ms, conn->disconnect_ms);
 	}
-	error = device_create_file(dev,&dev_attr_change);
-	if (error){
-		put_device(dev);
-		pr_err("No Change device attribute Added%d\n", error);
+	return 0;
+
+exit_src:
+	if (conn->src->exit)
+		conn->src->exit(conn);
+exit_misc:
+	kthread_cancel_delayed_work_sync(&conn->hpd_work);
+	misc_deregister(&conn->misc);
+exit_ida:
+	ida_simple_remove(&hdmi_ida, conn->index);
+	return error;
+}
+
+static int hdmi_rpi_remove(struct platform_device *pdev)
+{
+	struct hdmi_conn *conn = platform_get_drvdata(pdev);
+
+	if (conn->hpd_irq >= 0)
+		free_irq(conn->hpd_irq, conn);
+	/*
+	 * the timer queues poll_work, both works may re-arm the timer if
+	 * they looked at polling before it was cleared
+	 */
+	conn->polling = false;
+	del_timer_sync(&conn->poll_timer);
+	kthread_cancel_work_sync(&conn->poll_work);
+	kthread_cancel_delayed_work_sync(&conn->hpd_work);
+	del_timer_sync(&conn->poll_timer);
+	kthread_cancel_work_sync(&conn->poll_work);
+	if (conn->src->exit)
+		conn->src->exit(conn);
+	/*
+	 * power_work and proj_work queue each other. Once dying is set
+	 * neither does; only one that was already running may still have,
+	 * hence proj_work twice.
+	 */
+	mutex_lock(&conn->power_lock);
+	conn->dying = true;
+	mutex_unlock(&conn->power_lock);
+	kthread_cancel_delayed_work_sync(&conn->proj_work);
+	kthread_cancel_delayed_work_sync(&conn->power_work);
+	kthread_cancel_delayed_work_sync(&conn->proj_work);
+	if (conn->cec_file)
+		filp_close(conn->cec_file, NULL);
+	misc_deregister(&conn->misc);
+	if (!conn->src->connected) {
+		gpio_unexport(conn->gpio);
+		gpio_free(conn->gpio);
 	}
+	edid_snap_free(edid_snap_replace(conn, NULL));
+	ida_simple_remove(&hdmi_ida, conn->index);
+	pr_info("%s removed\n", conn->name);
+	return 0;
+}
+
+static struct platform_driver hdmi_rpi_driver = {
+	.probe = hdmi_rpi_probe,
+	.remove = hdmi_rpi_remove,
+	.driver = {
+		.name = "hdmi-rpi",
+		.owner = THIS_MODULE,
+		.of_match_table = of_match_ptr(hdmi_rpi_of_match),
+		/* readers may hold /dev/hdmi_device open, only unbind on rmmod */
+		.suppress_bind_attrs = true,
+	},
+};
+
+/*
+ * Every rpi,hdmi-rpi node probes its own connector. Without device
+ * tree a single platform device is created from the module parameters
+ * so the old setup keeps working.
+ */
+static int __init module_start(void)
+{
+	struct device_node *node;
+	int error = 0;
+
+	hpd_worker = kthread_create_worker(0, "hdmi-hotplug");
+	if (IS_ERR(hpd_worker))
+		return PTR_ERR(hpd_worker);
+	if (worker_prio > 0) {
+		struct sched_param param = {
+			.sched_priority = min(worker_prio, MAX_USER_RT_PRIO - 1),
+		};
+
+		sched_setscheduler(hpd_worker->task, SCHED_FIFO, &param);
+	}
+#ifdef CONFIG_DEBUG_FS
+	soft_root = debugfs_create_dir("hdmi-rpi", NULL);
 #endif
+
+	error = platform_driver_register(&hdmi_rpi_driver);
+	if (error) {
+		pr_err("error %d\n", error);
+		goto exit_worker;
+	}
+
+	node = of_find_compatible_node(NULL, NULL,
+				       hdmi_rpi_of_match[0].compatible);
+	if (node) {
+		/* DT-enabled */
+		of_node_put(node);
+		return 0;
+	}
+
+	hdmi_rpi_dev = platform_device_alloc("hdmi-rpi", 0);
+	if (!hdmi_rpi_dev) {
+		error = -ENOMEM;
+		goto exit_driver_unregister;
+	}
+	error = platform_device_add(hdmi_rpi_dev);
+	if (error)
+		goto exit_device_put;
 	return 0;
+
+exit_device_put:
+	platform_device_put(hdmi_rpi_dev);
+exit_driver_unregister:
+	platform_driver_unregister(&hdmi_rpi_driver);
+exit_worker:
+#ifdef CONFIG_DEBUG_FS
+	debugfs_remove_recursive(soft_root);
+#endif
+	kthread_destroy_worker(hpd_worker);
+	return error;
 }
 
 static void __exit module_end(void)
 {
-	misc_deregister(&hdmi_dev);
-	gpio_unexport(hdmi_gpio);
-	gpio_free(hdmi_gpio);
-	del_timer(&my_timer);
-	flush_workqueue(wq);
-	destroy_workqueue(wq);
-	pr_info("\n");
+	if (hdmi_rpi_dev)
+		platform_device_unregister(hdmi_rpi_dev);
+	platform_driver_unregister(&hdmi_rpi_driver);
+	kthread_destroy_worker(hpd_worker);
+#ifdef CONFIG_DEBUG_FS
+	debugfs_remove_recursive(soft_root);
+#endif
+	sink_table_free();
+}
+
+/* sleeps: EDID read from the source, never call from atomic context */
+static void hdmi_report_connect(struct hdmi_conn *conn){
+	struct hdmi_edid_snapshot *snap;
+	u32 type;
+	int error;
+
+	hdmi_set_state(conn, 1);
+	hdmi_queue_event(conn, HDMI_RPI_EV_CONNECT, NULL);
+
+	/* whatever was known belongs to the previous sink */
+	edid_snap_free(edid_snap_replace(conn, NULL));
+
+	snap = kzalloc(sizeof(*snap), GFP_KERNEL);
+	if (!snap)
+		return;
+	error = hdmi_read_edid(conn, snap->edid, &snap->blocks);
+	if (!error)
+		error = edid_parse(snap->edid[0], &snap->id);
+	if (error) {
+		pr_err("%s: EDID read failed %d\n", conn->name, error);
+		kfree(snap);
+		return;
+	}
+	if (!sink_lookup(&snap->id, snap->class, &snap->action)) {
+		/* not in the table, old heuristic */
+		snap->projector = snap->edid[0][99]=='P';
+		strlcpy(snap->class, snap->projector ? "projector" :
+			"unknown", sizeof(snap->class));
+		snap->action = snap->projector ? HDMI_ACTION_NONE :
+			HDMI_ACTION_NOTIFY;
+	}
+	snap->cec_pa = edid_cec_pa(snap->edid, snap->blocks);
+	WRITE_ONCE(conn->cec_pa, snap->cec_pa);
+	snap->crc = crc32_le(~0, (const u8 *)snap->edid,
+			     snap->blocks * EDID_LENGTH);
+	pr_info("%s: cached %s %04x \"%s\", %u blocks, %s/%s\n",
+		conn->name, snap->id.vendor, snap->id.product, snap->id.name,
+		snap->blocks, snap->class, hdmi_action_names[snap->action]);
+	edid_snap_replace(conn, snap);
+
+	/* a different sink than the one seen last */
+	type = conn->last_edid_crc && snap->crc != conn->last_edid_crc ?
+		HDMI_RPI_EV_EDID_CHANGED : HDMI_RPI_EV_IDENTITY;
+	conn->last_edid_crc = snap->crc;
+	hdmi_queue_event(conn, type, &snap->id);
+	sysfs_notify(&conn->misc.this_device->kobj, NULL, "class");
+}
+
+/* one send of lirc_rpi's code, runs on hpd_worker */
+static int hdmi_send_ir(struct hdmi_conn *conn){
+	int (*send)(int index);
+	int error;
+
+	send = symbol_get(lirc_rpi_send_default);
+	if (!send) {
+		pr_err("IR needed but lirc_rpi is not loaded\n");
+		return -ENODEV;
+	}
+	error = send(conn->ir_device);
+	if (error)
+		pr_err("IR send on lirc%d failed %d\n", conn->ir_device, error);
+	symbol_put(lirc_rpi_send_default);
+	return error;
 }
 
+#ifdef HDMI_RPI_CEC
+/*
+ * private_data is only a cec_fh on a CEC node. The CEC core hangs the
+ * node's cdev off its device on the cec bus; the parent is compared
+ * against our own device's ktype before it is taken for a device.
+ */
+static bool hdmi_is_cec_node(struct hdmi_conn *conn, struct file *file){
+	struct inode *inode = file_inode(file);
+	struct kobject *parent;
+	struct device *dev;
+
+	if (!S_ISCHR(inode->i_mode) || !inode->i_cdev || !file->private_data)
+		return false;
+	parent = inode->i_cdev->kobj.parent;
+	if (!parent ||
+	    get_ktype(parent) != get_ktype(&conn->misc.this_device->kobj))
+		return false;
+	dev = kobj_to_dev(parent);
+	return dev->bus && !strcmp(dev->bus->name, CEC_NAME);
+}
 
-static void work_handler(struct work_struct *work){
+/* hpd_worker only, the adapter stays open until the connector goes */
+static int hdmi_send_cec(struct hdmi_conn *conn, int want){
+	struct cec_adapter *adap;
+	struct cec_msg msg;
+	struct file *file;
 	int error;
-	struct device *dev = hdmi_dev.this_device;
-	get_projector_id(fwr,fw);
-	if(!(edid_tag1.edid_block[99]=='P')) {
 
-		error = kobject_uevent_env(&dev->kobj,KOBJ_CHANGE,envp);
-		if (error){
-			kobject_put(&dev->kobj);
-			pr_err("No kobject_uevent %d\n", error);
+	if (!*conn->cec_device || conn->cec_pa == EDID_NO_PA)
+		return -ENODEV;
+	if (!conn->cec_file) {
+		file = filp_open(conn->cec_device, O_RDWR, 0);
+		if (IS_ERR(file))
+			return PTR_ERR(file);
+		if (!hdmi_is_cec_node(conn, file)) {
+			pr_warn("%s: %s is not a CEC device\n", conn->name,
+				conn->cec_device);
+			filp_close(file, NULL);
+			return -ENODEV;
 		}
-		printk("after event");
+		conn->cec_file = file;
 	}
+	adap = ((struct cec_fh *)conn->cec_file->private_data)->adap;
+	/* no logical address claimed, nothing to send from */
+	if (!adap->is_configured ||
+	    adap->log_addrs.log_addr[0] == CEC_LOG_ADDR_INVALID)
+		return -ENONET;
+
+	/* a projector takes the TV's logical address */
+	cec_msg_init(&msg, adap->log_addrs.log_addr[0], CEC_LOG_ADDR_TV);
+	if (want)
+		cec_msg_image_view_on(&msg);
+	else
+		cec_msg_standby(&msg);
+	error = cec_transmit_msg(adap, &msg, true);
+	if (!error && !(msg.tx_status & CEC_TX_STATUS_OK))
+		error = -EIO;
+	if (error || !want)
+		return error;
+
+	/* and switch it to our input, nothing to retry if it is ignored */
+	cec_msg_init(&msg, adap->log_addrs.log_addr[0],
+		     CEC_LOG_ADDR_BROADCAST);
+	cec_msg_active_source(&msg, conn->cec_pa);
+	cec_transmit_msg(adap, &msg, true);
+	return 0;
+}
+#else
+static int hdmi_send_cec(struct hdmi_conn *conn, int want){
+	return -ENODEV;
+}
+#endif
+
+/* CEC when the sink has it, IR otherwise or when CEC fails */
+static int hdmi_send_power(struct hdmi_conn *conn, int want){
+	int error;
+
+	error = hdmi_send_cec(conn, want);
+	if (!error)
+		return 0;
+	if (error != -ENODEV)
+		pr_info("%s: CEC %s failed %d, using IR\n", conn->name,
+			power_names[want], error);
+	return hdmi_send_ir(conn);
+}
+
+static void hdmi_power_done(struct hdmi_conn *conn, const char *result){
+	WRITE_ONCE(conn->power_want, -1);
+	WRITE_ONCE(conn->power_result, result);
+	sysfs_notify(&conn->misc.this_device->kobj, NULL, "power");
+}
+
+static void hdmi_proj_set(struct hdmi_conn *conn, int state,
+			  unsigned int ms){
+	WRITE_ONCE(conn->proj_state, state);
+	WRITE_ONCE(conn->proj_known, true);
+	/* a stale proj_work finds a settled state and does nothing */
+	if ((state == PROJ_WARMING || state == PROJ_COOLING) &&
+	    !READ_ONCE(conn->dying))
+		kthread_mod_delayed_work(hpd_worker, &conn->proj_work,
+					 msecs_to_jiffies(ms));
+	sysfs_notify(&conn->misc.this_device->kobj, NULL, "projector");
 }
+
+/* warm-up or cool-down is over, a command held back can go now */
+static void proj_work_fn(struct kthread_work *work){
+	struct hdmi_conn *conn = container_of(work, struct hdmi_conn,
+					      proj_work.work);
+	int on;
+
+	if (conn->proj_state == PROJ_WARMING)
+		on = 1;
+	else if (conn->proj_state == PROJ_COOLING)
+		on = 0;
+	else
+		return;
+	/* hotplug never followed the command, believe hotplug */
+	if (conn->proj_by_cmd && conn->hdmi_pin != on) {
+		pr_info("%s: projector did not follow %s\n", conn->name,
+			power_names[on]);
+		on = conn->hdmi_pin;
+	}
+	conn->proj_by_cmd = false;
+	hdmi_proj_set(conn, on ? PROJ_ON : PROJ_OFF, 0);
+	if (conn->power_want >= 0 && !READ_ONCE(conn->dying))
+		kthread_mod_delayed_work(hpd_worker, &conn->power_work, 0);
+}
+
+/* a settled hotplug change; the first one only tells where we are */
+static void hdmi_proj_observe(struct hdmi_conn *conn, int connected){
+	int state = conn->proj_state;
+
+	/* whatever a command started has been confirmed or overtaken */
+	conn->proj_by_cmd = false;
+	if (!conn->proj_known)
+		hdmi_proj_set(conn, connected ? PROJ_ON : PROJ_OFF, 0);
+	else if (connected && (state == PROJ_OFF || state == PROJ_COOLING))
+		hdmi_proj_set(conn, PROJ_WARMING, conn->warmup_ms);
+	else if (!connected && (state == PROJ_ON || state == PROJ_WARMING))
+		hdmi_proj_set(conn, PROJ_COOLING, conn->cooldown_ms);
+}
+
+enum { PROJ_SEND, PROJ_DEFER, PROJ_SUPPRESS };
+
+/* whether sending POWER for want makes sense in the projector's state */
+static int hdmi_proj_gate(struct hdmi_conn *conn, int want){
+	if (!conn->proj_known)
+		return PROJ_SEND;
+	switch (conn->proj_state) {
+	case PROJ_WARMING:
+		/* our own on, a resend waits to see whether it landed */
+		if (want && conn->proj_by_cmd)
+			return PROJ_DEFER;
+		return want ? PROJ_SUPPRESS : PROJ_DEFER;
+	case PROJ_ON:
+		return want ? PROJ_SUPPRESS : PROJ_SEND;
+	case PROJ_COOLING:
+		if (!want && conn->proj_by_cmd)
+			return PROJ_DEFER;
+		return want ? PROJ_DEFER : PROJ_SUPPRESS;
+	default:
+		return want ? PROJ_SEND : PROJ_SUPPRESS;
+	}
+}
+
+/* starts over, a pending command is dropped; hpd_worker only */
+static void hdmi_power_request(struct hdmi_conn *conn, int want){
+	WRITE_ONCE(conn->power_want, want);
+	WRITE_ONCE(conn->power_tries, 0);
+	kthread_mod_delayed_work(hpd_worker, &conn->power_work, 0);
+}
+
+/*
+ * Sends once per run. The send starts a warm-up or cool-down and
+ * proj_work runs us again at its end: if nothing acked the command
+ * meanwhile, send again or give up.
+ */
+static void power_work_fn(struct kthread_work *work){
+	struct hdmi_conn *conn = container_of(work, struct hdmi_conn,
+					      power_work.work);
+	int want = xchg(&conn->power_req, -1);
+	unsigned int ms;
+	u64 timestamp;
+
+	/* the same request again joins the one in flight */
+	if (want >= 0 && want != conn->power_want) {
+		WRITE_ONCE(conn->power_want, want);
+		WRITE_ONCE(conn->power_tries, 0);
+	}
+	want = conn->power_want;
+	if (want < 0)
+		return;
+
+	/* POWER toggles, sending it to a sink already there turns it off */
+	if (!conn->power_tries && conn->hdmi_pin == want) {
+		hdmi_power_done(conn, "ok");
+		return;
+	}
+	switch (hdmi_proj_gate(conn, want)) {
+	case PROJ_DEFER:
+		/* proj_work runs us again once the projector settles */
+		if (!conn->power_tries)
+			WRITE_ONCE(conn->proj_deferred,
+				   conn->proj_deferred + 1);
+		pr_debug("%s: %s waits for %s to end\n", conn->name,
+			 power_names[want], proj_names[conn->proj_state]);
+		return;
+	case PROJ_SUPPRESS:
+		WRITE_ONCE(conn->proj_suppressed, conn->proj_suppressed + 1);
+		pr_info("%s: %s dropped, projector %s\n", conn->name,
+			power_names[want], proj_names[conn->proj_state]);
+		hdmi_power_done(conn, "suppressed");
+		return;
+	}
+	if (conn->power_tries >= ir_repeat) {
+		pr_info("%s: no %s after %u sends\n", conn->name,
+			power_names[want], conn->power_tries);
+		hdmi_power_done(conn, "timeout");
+		timestamp = hdmi_queue_event(conn, HDMI_RPI_EV_POWER_TIMEOUT,
+					     NULL);
+		hdmi_uevent(conn, "power-timeout", NULL, NULL, 0, timestamp);
+		return;
+	}
+	WRITE_ONCE(conn->power_tries, conn->power_tries + 1);
+	if (hdmi_send_power(conn, want)) {
+		hdmi_power_done(conn, "error");
+		return;
+	}
+	/* the end of it is the deadline, proj_work runs us then */
+	ms = max(want ? conn->warmup_ms : conn->cooldown_ms, ir_repeat_ms);
+	conn->proj_by_cmd = true;
+	hdmi_proj_set(conn, want ? PROJ_WARMING : PROJ_COOLING, ms);
+}
+
+/* a settled hotplug change, true when it was what a command asked for */
+static bool hdmi_power_observe(struct hdmi_conn *conn, int connected){
+	if (conn->power_want != connected)
+		return false;
+	kthread_cancel_delayed_work_sync(&conn->power_work);
+	pr_info("%s: %s acked after %u sends\n", conn->name,
+		power_names[connected], conn->power_tries);
+	hdmi_power_done(conn, "ok");
+	hdmi_queue_event(conn, HDMI_RPI_EV_POWER_ACK, NULL);
+	/* the cancel also dropped the run for a write that came in since */
+	if (READ_ONCE(conn->power_req) >= 0)
+		kthread_mod_delayed_work(hpd_worker, &conn->power_work, 0);
+	return true;
+}
+
+/* decides from the cached identity, no mailbox call */
+static void hdmi_report_disconnect(struct hdmi_conn *conn, bool acked){
+	int error;
+	struct hdmi_edid_snapshot *snap;
+	u64 timestamp;
+
+	/*
+	 * Unpublished right away so sysfs stops showing the old sink, but
+	 * still ours to read until edid_snap_free(): only this worker frees it.
+	 */
+	snap = edid_snap_replace(conn, NULL);
+
+	hdmi_set_state(conn, 0);
+	timestamp = hdmi_queue_event(conn, HDMI_RPI_EV_DISCONNECT,
+				     snap ? &snap->id : NULL);
+
+	/* nothing cached: unknown sink, report it like any other */
+	if (!snap || snap->action == HDMI_ACTION_NOTIFY) {
+		error = hdmi_uevent(conn, "disconnected",
+				    snap ? &snap->id : NULL,
+				    snap ? snap->class : "",
+				    snap ? snap->crc : 0, timestamp);
+		if (error)
+			pr_err("No kobject_uevent %d\n", error);
+		/* unless we switched it off on purpose, bring it back */
+		if (!acked && !strcmp(ir_action, "default"))
+			hdmi_power_request(conn, 1);
+	}
+	edid_snap_free(snap);
+}
+
+/* a change was seen, look again soon in case it bounces back */
+static void hdmi_poll_fast(struct hdmi_conn *conn){
+	if (!conn->polling)
+		return;
+	WRITE_ONCE(conn->poll_ms, poll_min_ms);
+	mod_timer(&conn->poll_timer, jiffies + msecs_to_jiffies(poll_min_ms));
+}
+
+/* how long the line must keep a level before it counts, in jiffies */
+static unsigned long hdmi_settle_delay(struct hdmi_conn *conn, int level){
+	return msecs_to_jiffies(level ? conn->disconnect_ms :
+				conn->debounce_ms);
+}
+
+/*
+ * True when this change is one too many for the window. hpd_work then
+ * runs again at the end of the window, unless an edge comes first.
+ */
+static bool hdmi_flap_limited(struct hdmi_conn *conn){
+	/* both are writable, take them once */
+	unsigned int burst = READ_ONCE(flap_burst);
+	unsigned long window = msecs_to_jiffies(READ_ONCE(flap_window_ms));
+	unsigned long now = jiffies;
+
+	if (!burst)
+		return false;
+	if (time_after_eq(now, conn->flap_window_start + window)) {
+		conn->flap_window_start = now;
+		conn->flap_count = 0;
+	}
+	if (conn->flap_count < burst) {
+		conn->flap_count++;
+		return false;
+	}
+	WRITE_ONCE(conn->flaps_suppressed, conn->flaps_suppressed + 1);
+	kthread_mod_delayed_work(hpd_worker, &conn->hpd_work,
+				 conn->flap_window_start + window - now);
+	return true;
+}
+
+static void hpd_work_fn(struct kthread_work *work){
+	struct hdmi_conn *conn = container_of(work, struct hdmi_conn,
+					      hpd_work.work);
+	bool acked;
+	int value;
+
+	value = hdmi_hpd_level(conn);
+	if (value == conn->hpd_settled)
+		return;
+	if (hdmi_flap_limited(conn)) {
+		pr_debug("%s: flap to %d held back\n", conn->name, value);
+		return;
+	}
+	conn->hpd_settled = value;
+	pr_info("%s: hotplug %s settled at %d\n", conn->name,
+		conn->src->name, value);
+	hdmi_poll_fast(conn);
+
+	/* high means the sink went away */
+	hdmi_proj_observe(conn, !value);
+	acked = hdmi_power_observe(conn, !value);
+	if (value == 1)
+		hdmi_report_disconnect(conn, acked);
+	else
+		hdmi_report_connect(conn);
+}
+
+static irqreturn_t hdmi_hpd_irq(int irq, void *dev_id){
+	struct hdmi_conn *conn = dev_id;
+
+	/* every edge restarts the settle time, that of the new level */
+	kthread_mod_delayed_work(hpd_worker, &conn->hpd_work,
+				 hdmi_settle_delay(conn,
+						   hdmi_hpd_level(conn)));
+	return IRQ_HANDLED;
+}
+
+static int hdmi_hpd_irq_init(struct hdmi_conn *conn){
+	int irq, error;
+
+	irq = gpio_to_irq(conn->gpio);
+	if (irq < 0)
+		return irq;
+	/* threaded when the line sits on an expander that sleeps */
+	error = request_any_context_irq(irq, hdmi_hpd_irq,
+				IRQF_TRIGGER_RISING | IRQF_TRIGGER_FALLING,
+				conn->name, conn);
+	if (error < 0)
+		return error;
+	conn->hpd_irq = irq;
+	return 0;
+}
+
 static void my_timer_callback(unsigned long data){
-	printk(KERN_INFO "inside timer routine\n");
-	static int error;
-	static int count=0;
-	count++;
-	printk(KERN_INFO "gpio46 val := %d\n",gpio_get_value(hdmi_gpio));
-	if(gpio_get_value(hdmi_gpio) == 1){ //&& gpio_get_value(hdmi_gpio) !=past_46 ){
-		printk(KERN_INFO "inside inner loop\n");
-		if(flag==0){
-			//flag=0;
-			printk("before event\n");
-			struct work_data * data;;
-			data = kmalloc(sizeof(struct work_data), GFP_KERNEL);
-			INIT_WORK(&data->work, work_handler);
-			queue_work(wq, &data->work);
-		}
-		flag=1;
+	struct hdmi_conn *conn = (struct hdmi_conn *)data;
+
+	pr_debug("inside timer routine\n");
+	kthread_queue_work(hpd_worker, &conn->poll_work);
+}
+
+/* on hpd_worker, so the level may be read from a sleeping GPIO */
+static void poll_work_fn(struct kthread_work *work){
+	struct hdmi_conn *conn = container_of(work, struct hdmi_conn,
+					      poll_work);
+	unsigned int period = READ_ONCE(conn->poll_ms);
+	unsigned long next;
+
+	if (!READ_ONCE(conn->polling))
+		return;
+	WRITE_ONCE(conn->poll_wakeups, conn->poll_wakeups + 1);
+	if (time_after_eq(jiffies, conn->poll_hour_start + 3600 * HZ)) {
+		WRITE_ONCE(conn->poll_last_hour,
+			   conn->poll_wakeups - conn->poll_hour_base);
+		WRITE_ONCE(conn->poll_hour_base, conn->poll_wakeups);
+		conn->poll_hour_start = jiffies;
 	}
-	else {
-		flag=0;
+
+	/* only GPIO sources poll, the others report hotplug themselves */
+	if (hdmi_hpd_level(conn) != READ_ONCE(conn->hpd_settled)) {
+		pr_debug("inside inner loop\n");
+		/* 1: sink went away, 0: sink connected, prefetch EDID */
+		kthread_queue_delayed_work(hpd_worker, &conn->hpd_work,
+					   hdmi_settle_delay(conn,
+						!READ_ONCE(conn->hpd_settled)));
+		period = poll_min_ms;
 	}
-	mod_timer(&my_timer,jiffies+secs_to_jiffies((interval)));
+
+	/* quiet poll, back off; the work resets this on a change */
+	WRITE_ONCE(conn->poll_ms, clamp(period * 2, poll_min_ms, poll_max_ms));
+	next = msecs_to_jiffies(period);
+	if (period >= 1000)
+		next = round_jiffies_relative(next);
+	mod_timer(&conn->poll_timer, jiffies + next);
 }
 module_init(module_start);
 module_exit(module_end);
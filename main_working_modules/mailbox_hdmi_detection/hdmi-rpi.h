@@ -0,0 +1,43 @@
+/*
+ * hdmi-rpi.h
+ *
+ * Event records read from /dev/hdmi_device.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ */
+
+#ifndef _HDMI_RPI_H
+#define _HDMI_RPI_H
+
+#include <linux/types.h>
+
+/* hdmi_rpi_event.type */
+#define HDMI_RPI_EV_CONNECT	1	/* hotplug settled high -> low */
+#define HDMI_RPI_EV_DISCONNECT	2
+#define HDMI_RPI_EV_IDENTITY	3	/* EDID read, identity filled in */
+#define HDMI_RPI_EV_EDID_CHANGED 4	/* like IDENTITY, different sink */
+#define HDMI_RPI_EV_OVERFLOW	5	/* reader fell behind, events lost */
+#define HDMI_RPI_EV_POWER_ACK	6	/* sink followed a power command */
+#define HDMI_RPI_EV_POWER_TIMEOUT 7	/* it did not, gave up resending */
+
+/*
+ * Every read() returns whole records. seq counts every event ever
+ * queued, so a gap in seq also shows lost events. The identity fields
+ * describe the sink the event is about and are zero when unknown.
+ */
+struct hdmi_rpi_event {
+	__u64 timestamp;	/* CLOCK_MONOTONIC, ns */
+	__u32 type;
+	__u32 seq;
+	char vendor[4];		/* PNP ID, NUL terminated */
+	__u16 product;
+	__u16 reserved;
+	__u32 serial;
+	char name[14];		/* monitor name, NUL terminated */
+	__u8 reserved2[2];
+};
+
+#endif /* _HDMI_RPI_H */